@@ -0,0 +1,62 @@
+/**
+  Lock-free frame ring for the OXRS BMD PDU firmware
+
+  Hands sensor scans from the sensor task (single producer) to loop()
+  (single consumer) without either ever waiting on the other. No hardware
+  access, so it can be tested on the host (see test/ and "pio test -e native").
+*/
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+template <typename T, uint32_t COUNT>
+class FrameRing
+{
+  static_assert(COUNT > 0 && (COUNT & (COUNT - 1)) == 0, "COUNT must be a power of 2");
+
+  public:
+    FrameRing() : _head(0), _tail(0) {}
+
+    // Producer only, returns false (and the frame is dropped) if the ring is full
+    bool push(const T & frame)
+    {
+      uint32_t head = _head.load(std::memory_order_relaxed);
+      uint32_t tail = _tail.load(std::memory_order_acquire);
+
+      if (head - tail >= COUNT)
+        return false;
+
+      _frames[head & (COUNT - 1)] = frame;
+      _head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer only, the oldest frame (still owned by the consumer until it is
+    // popped) or nullptr if the ring is empty
+    T * peek()
+    {
+      uint32_t tail = _tail.load(std::memory_order_relaxed);
+      if (tail == _head.load(std::memory_order_acquire))
+        return nullptr;
+
+      return &_frames[tail & (COUNT - 1)];
+    }
+
+    // Consumer only, hand the oldest frame back to the producer
+    void pop()
+    {
+      _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Frames waiting for the consumer
+    uint32_t count()
+    {
+      return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+    }
+
+  private:
+    T _frames[COUNT];
+    std::atomic<uint32_t> _head;
+    std::atomic<uint32_t> _tail;
+};
@@ -0,0 +1,119 @@
+/**
+  Static JSON arenas for the OXRS BMD PDU firmware
+
+  ArduinoJson allocators over fixed buffers, so building and publishing
+  payloads never touches the heap. No hardware access, so they can be
+  tested on the host (see test/ and "pio test -e native").
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ArduinoJson.h>
+
+// Block alignment (and size header) within an arena
+#define       JSON_ARENA_ALIGN        8
+
+// Bump allocator over a fixed buffer, each block prefixed with its size so
+// it can be grown. Freed blocks are only reclaimed when the arena is reset
+// (after clearing the document using it) or if they are the last allocated.
+class JsonArena : public ArduinoJson::Allocator
+{
+  public:
+    JsonArena(uint8_t * buffer, size_t size) : _buffer(buffer), _size(size), _used(0), _peak(0), _overflows(0) {}
+
+    void * allocate(size_t size) override
+    {
+      size_t block = JSON_ARENA_ALIGN + align(size);
+      if (_used + block > _size)
+      {
+        _overflows++;
+        return nullptr;
+      }
+
+      size_t * header = (size_t *)&_buffer[_used];
+      *header = size;
+
+      _used += block;
+      if (_used > _peak) { _peak = _used; }
+      return (uint8_t *)header + JSON_ARENA_ALIGN;
+    }
+
+    void deallocate(void * ptr) override
+    {
+      // Only the last block can be given back before a reset
+      if (ptr != nullptr && isLast(ptr))
+      {
+        _used = (uint8_t *)ptr - JSON_ARENA_ALIGN - _buffer;
+      }
+    }
+
+    void * reallocate(void * ptr, size_t size) override
+    {
+      if (ptr == nullptr)
+        return allocate(size);
+
+      size_t * header = (size_t *)((uint8_t *)ptr - JSON_ARENA_ALIGN);
+
+      // Grow (or shrink) the last block in place
+      if (isLast(ptr))
+      {
+        size_t start = (uint8_t *)ptr - _buffer;
+        if (start + align(size) > _size)
+        {
+          _overflows++;
+          return nullptr;
+        }
+
+        *header = size;
+        _used = start + align(size);
+        if (_used > _peak) { _peak = _used; }
+        return ptr;
+      }
+
+      if (size <= *header)
+        return ptr;
+
+      // Otherwise move it to the end
+      void * moved = allocate(size);
+      if (moved != nullptr)
+      {
+        memcpy(moved, ptr, *header);
+      }
+      return moved;
+    }
+
+    void reset() { _used = 0; }
+    size_t used() { return _used; }
+    size_t peak() { return _peak; }
+    size_t size() { return _size; }
+
+    // Allocations refused because the arena was full
+    uint32_t overflows() { return _overflows; }
+
+  private:
+    uint8_t * _buffer;
+    size_t _size;
+    size_t _used;
+    size_t _peak;
+    uint32_t _overflows;
+
+    static size_t align(size_t size) { return (size + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1); }
+
+    bool isLast(void * ptr)
+    {
+      size_t * header = (size_t *)((uint8_t *)ptr - JSON_ARENA_ALIGN);
+      return (uint8_t *)ptr + align(*header) == &_buffer[_used];
+    }
+};
+
+template <size_t SIZE>
+class StaticJsonArena : public JsonArena
+{
+  public:
+    StaticJsonArena() : JsonArena(_storage, SIZE) {}
+
+  private:
+    alignas(JSON_ARENA_ALIGN) uint8_t _storage[SIZE];
+};
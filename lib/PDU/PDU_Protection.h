@@ -0,0 +1,116 @@
+/**
+  Per-output over-current protection for the OXRS BMD PDU firmware
+
+  Pure maths, with no hardware access, so it can be tested on the host
+  (see test/ and "pio test -e native").
+*/
+#pragma once
+
+#include <stdint.h>
+
+// With a trip delay but no instant limit configured, hard shorts still trip
+// straight away above this multiple of the over-current limit (capped at the
+// INA260 full scale) and anything below is left to the I^2t curve
+#define       PROTECTION_INSTANT_LIMIT_MULTIPLE   4
+#define       PROTECTION_INSTANT_LIMIT_MAX_MA     15000
+
+// Per-output protection settings (set by config) and state (owned by the sensor task)
+typedef struct
+{
+  uint16_t limit_mA;                  // continuous over-current limit
+  uint16_t instantLimit_mA;           // trip on the first sample above this (0 for the default)
+  uint16_t tripDelay_ms;              // time to trip at twice the limit (0 to trip immediately)
+  uint16_t inrush_mA;                 // allowed for inrushTime_ms after switching on
+  uint16_t inrushTime_ms;
+  uint8_t retryCount;                 // auto re-close attempts after an over-current trip
+  uint16_t retryDelay_s;              // doubles with each attempt
+  uint8_t priority;                   // lowest priority outputs are shed first
+
+  uint64_t overload;                  // accumulated (mA^2 - limit^2) x ms
+  uint32_t lastSample;
+  uint32_t onTime;
+  uint32_t retryTime;                 // when to re-close (0 if none pending)
+  uint8_t retries;
+  int32_t shed_mA;                    // current drawn when shed
+} protection_t;
+
+inline uint16_t getInstantLimit(const protection_t * protection)
+{
+  uint16_t limit = protection->limit_mA;
+
+  // A configured instant limit is never below the continuous limit
+  if (protection->instantLimit_mA > 0)
+    return protection->instantLimit_mA > limit ? protection->instantLimit_mA : limit;
+
+  // Without a trip delay everything over the limit trips straight away
+  if (protection->tripDelay_ms == 0)
+    return limit;
+
+  uint32_t instantLimit = (uint32_t)limit * PROTECTION_INSTANT_LIMIT_MULTIPLE;
+  if (instantLimit > PROTECTION_INSTANT_LIMIT_MAX_MA) { instantLimit = PROTECTION_INSTANT_LIMIT_MAX_MA; }
+  return instantLimit > limit ? instantLimit : limit;
+}
+
+inline uint16_t getAlertLimit(const protection_t * protection)
+{
+  // The INA260 alert (and interrupt trip) fires at the highest current we
+  // could allow, the sensor task handles everything below that
+  uint16_t alertLimit = getInstantLimit(protection);
+  if (protection->inrush_mA > alertLimit) { alertLimit = protection->inrush_mA; }
+  return alertLimit;
+}
+
+inline bool isOverCurrent(protection_t * protection, uint32_t timestamp, int32_t mA)
+{
+  uint32_t elapsed = protection->lastSample == 0L ? 0L : timestamp - protection->lastSample;
+  protection->lastSample = timestamp;
+
+  int32_t limit = protection->limit_mA;
+  int32_t instantLimit = getInstantLimit(protection);
+
+  // Allow for inrush while the output is switching on
+  if ((timestamp - protection->onTime) < protection->inrushTime_ms)
+  {
+    if (protection->inrush_mA > limit) { limit = protection->inrush_mA; }
+    if (limit > instantLimit) { instantLimit = limit; }
+  }
+
+  // Hard shorts trip straight away
+  if (mA > instantLimit)
+    return true;
+
+  // Integrate time over threshold (an I^2t curve) so short overloads ride
+  // through and the overload drains away again when back under the limit
+  uint64_t limitSquared = (uint64_t)limit * limit;
+  uint64_t mASquared = (uint64_t)((int64_t)mA * mA);
+
+  if (mASquared > limitSquared)
+  {
+    if (protection->tripDelay_ms == 0)
+      return true;
+
+    protection->overload += (mASquared - limitSquared) * elapsed;
+
+    // (2I)^2 - I^2 = 3I^2, so this trips after tripDelay_ms at twice the limit
+    if (protection->overload >= 3 * limitSquared * protection->tripDelay_ms)
+      return true;
+  }
+  else
+  {
+    uint64_t headroom = (limitSquared - mASquared) * elapsed;
+    protection->overload = protection->overload > headroom ? protection->overload - headroom : 0LL;
+  }
+
+  return false;
+}
+
+inline bool scheduleRetry(protection_t * protection, uint32_t timestamp)
+{
+  if (protection->retries >= protection->retryCount)
+    return false;
+
+  // Back off exponentially with each attempt
+  protection->retryTime = timestamp + ((uint32_t)protection->retryDelay_s * 1000L << protection->retries);
+  if (protection->retryTime == 0L) { protection->retryTime = 1L; }
+  return true;
+}
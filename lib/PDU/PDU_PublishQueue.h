@@ -0,0 +1,220 @@
+/**
+  Bounded status event queue for the OXRS BMD PDU firmware
+
+  Statically allocated, drained in order by loop() and left intact when a
+  publish fails so everything is replayed, after a back-off, once the broker
+  is back. When full a relay event superseded by a newer one for the same
+  output is coalesced, or failing that the oldest relay event is dropped,
+  flagging a resync so the current state of every output can be republished.
+  Alerts are only ever merged into a newer identical alert (same output and
+  alert type), so none are lost as long as the queue can hold one of each.
+  No hardware access, so it can be tested on the host (see test/ and
+  "pio test -e native").
+*/
+#pragma once
+
+#include <stdint.h>
+
+// Status event type for alerts (anything else is an output type, e.g. RELAY)
+#define       ALERT_EVENT             0xFF
+
+typedef struct
+{
+  uint8_t index;
+  uint8_t type;
+  uint8_t event;
+} statusEvent_t;
+
+template <uint8_t SIZE>
+class StatusEventQueue
+{
+  public:
+    StatusEventQueue() : _head(0), _count(0), _maxCount(0), _dropped(0), _coalesced(0), _resync(false) {}
+
+    // Position 0 is the oldest event
+    statusEvent_t * get(uint8_t position)
+    {
+      return &_events[(_head + position) % SIZE];
+    }
+
+    void remove(uint8_t position)
+    {
+      // Close the gap, keeping the remaining events in order
+      for (uint8_t i = position; i > 0; i--)
+      {
+        *get(i) = *get(i - 1);
+      }
+
+      _head = (_head + 1) % SIZE;
+      _count--;
+    }
+
+    void push(uint8_t index, uint8_t type, uint8_t event)
+    {
+      if (_count == SIZE && !makeSpace())
+      {
+        _dropped++;
+        _resync = true;
+        return;
+      }
+
+      statusEvent_t * statusEvent = get(_count++);
+      statusEvent->index = index;
+      statusEvent->type = type;
+      statusEvent->event = event;
+
+      if (_count > _maxCount) { _maxCount = _count; }
+    }
+
+    // Publish up to burst events, oldest first, stopping at (and keeping) the
+    // first one which fails - false if any failed
+    template <typename Publish>
+    bool drain(uint8_t burst, Publish publish)
+    {
+      for (uint8_t i = 0; i < burst && _count > 0; i++)
+      {
+        if (!publish(get(0)))
+          return false;
+
+        remove(0);
+      }
+      return true;
+    }
+
+    uint8_t count() { return _count; }
+    uint8_t maxCount() { return _maxCount; }
+    uint32_t dropped() { return _dropped; }
+    uint32_t coalesced() { return _coalesced; }
+
+    // True (once) if any event has been dropped, i.e. the state of every
+    // output needs republishing
+    bool takeResync()
+    {
+      bool resync = _resync;
+      _resync = false;
+      return resync;
+    }
+
+  private:
+    statusEvent_t _events[SIZE];
+    uint8_t _head;
+    uint8_t _count;
+    uint8_t _maxCount;
+    uint32_t _dropped;
+    uint32_t _coalesced;
+    bool _resync;
+
+    bool isRelaySuperseded(uint8_t position)
+    {
+      statusEvent_t * event = get(position);
+      if (event->type == ALERT_EVENT)
+        return false;
+
+      // A newer relay event for the same output reflects its current state
+      for (uint8_t i = position + 1; i < _count; i++)
+      {
+        if (get(i)->index == event->index && get(i)->type != ALERT_EVENT)
+          return true;
+      }
+      return false;
+    }
+
+    bool isAlertRepeated(uint8_t position)
+    {
+      statusEvent_t * event = get(position);
+      if (event->type != ALERT_EVENT)
+        return false;
+
+      // Only the very same alert again, anything else would lose an alert
+      for (uint8_t i = position + 1; i < _count; i++)
+      {
+        if (get(i)->index == event->index && get(i)->type == ALERT_EVENT && get(i)->event == event->event)
+          return true;
+      }
+      return false;
+    }
+
+    bool makeSpace()
+    {
+      // Drop the oldest relay event with a newer one for the same output
+      for (uint8_t i = 0; i < _count; i++)
+      {
+        if (isRelaySuperseded(i))
+        {
+          remove(i);
+          _coalesced++;
+          return true;
+        }
+      }
+
+      // Otherwise lose the oldest relay event and resync once drained
+      for (uint8_t i = 0; i < _count; i++)
+      {
+        if (get(i)->type != ALERT_EVENT)
+        {
+          remove(i);
+          _dropped++;
+          _resync = true;
+          return true;
+        }
+      }
+
+      // Only alerts left, merge the oldest into a newer identical one
+      for (uint8_t i = 0; i < _count; i++)
+      {
+        if (isAlertRepeated(i))
+        {
+          remove(i);
+          _coalesced++;
+          return true;
+        }
+      }
+
+      // Every alert is different, which can't happen if the queue holds one
+      // of each for every output, but if it ever does the new event is dropped
+      return false;
+    }
+};
+
+// Back-off shared by everything loop() publishes, so once a publish fails
+// nothing more is attempted until the retry is due, and then everything
+// still pending is replayed in order
+class PublishBackoff
+{
+  public:
+    PublishBackoff(uint32_t retry_ms) : _retry_ms(retry_ms), _retryTime(0), _failures(0), _failed(false) {}
+
+    // Whether publishing should wait for the retry
+    bool isWaiting(uint32_t now)
+    {
+      return _failed && (now - _retryTime) < _retry_ms;
+    }
+
+    // Back off and try again shortly, leaving everything queued
+    void fail(uint32_t now)
+    {
+      _failed = true;
+      _failures++;
+      _retryTime = now;
+    }
+
+    // True (once) when publishing has recovered and everything queued has
+    // been replayed
+    bool takeRecovered(bool drained)
+    {
+      if (!_failed || !drained)
+        return false;
+
+      _failed = false;
+      return true;
+    }
+
+    bool isFailed() { return _failed; }
+    uint32_t failures() { return _failures; }
+
+  private:
+    uint32_t _retry_ms;
+    uint32_t _retryTime;
+    uint32_t _failures;
+    bool _failed;
+};
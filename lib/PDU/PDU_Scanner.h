@@ -0,0 +1,568 @@
+/**
+  Sensor scan for the OXRS BMD PDU firmware
+
+  One sweep of every fitted INA260 - over-current and voltage protection,
+  load shedding and restore, the power-on sequencer and adaptive scanning.
+  All hardware access goes through a small bus interface (INA260 registers
+  and the output relays), so a sweep can be driven against register models
+  on the host (see test/ and "pio test -e native").
+*/
+#pragma once
+
+#include <stdint.h>
+#include <PDU_Protection.h>
+
+// INA260 registers and scaling (LSB values from the datasheet)
+#define       INA_REG_CURRENT         0x01
+#define       INA_REG_BUSVOLTAGE      0x02
+#define       INA_REG_MASK_ENABLE     0x06
+#define       INA260_CURRENT_LSB_UA   1250L
+#define       INA260_VOLTAGE_LSB_UV   1250L
+
+// INA260 averaging counts and conversion times, in register order
+const uint16_t INA_AVERAGING_COUNTS[]     = { 1, 4, 16, 64, 128, 256, 512, 1024 };
+const uint16_t INA_CONVERSION_TIMES_US[]  = { 140, 204, 332, 558, 1100, 2116, 4156, 8244 };
+
+// Alert types
+#define       ALERT_TYPE_NONE         0
+#define       ALERT_TYPE_V_OVER       1
+#define       ALERT_TYPE_V_UNDER      2
+#define       ALERT_TYPE_I_OVER       3
+#define       ALERT_TYPE_I_OVER_TOTAL 4
+
+// Output stays healthy this long after an auto re-close to reset its retry count
+#define       RETRY_RESET_MS          60000L
+
+// Adaptive scanning reads idle outputs every few scans, but keeps reading hot
+// outputs (switched on recently, drawing over this % of their limit or with a
+// step change of at least this many mA) every scan until they settle
+#define       SCAN_HOT_PERCENT        50L
+#define       SCAN_TRANSIENT_MA       100L
+#define       SCAN_HOT_HOLD_MS        1000L
+
+// Output power-on states (configurable per output via "powerOnState")
+#define       POWER_ON_LAST           0
+#define       POWER_ON_ON             1
+#define       POWER_ON_OFF            2
+
+// Outputs switched on at boot, or several at once by command, are closed one
+// at a time by the power-on sequencer, waiting for each output's current to
+// change by no more than the settle threshold between scans (or this long)
+// before closing the next
+#define       SEQUENCE_SETTLE_TIMEOUT_MS 2000L
+
+// Per-output power-on settings (set by config, persisted so they apply at boot)
+typedef struct
+{
+  uint8_t state;                      // POWER_ON_LAST, POWER_ON_ON or POWER_ON_OFF
+  uint8_t order;                      // sequenced lowest first, equal orders by index
+  uint16_t delay_ms;                  // minimum wait before sequencing the next output
+} powerOn_t;
+
+// A single sensor scan, handed from the sensor task to loop()
+template <uint8_t COUNT>
+struct PduFrame
+{
+  uint32_t timestamp;
+  int32_t mA[COUNT];
+  uint32_t mV[COUNT];
+  uint32_t mW[COUNT];
+  uint8_t alertType[COUNT];
+  uint16_t sampled;                   // outputs with a fresh reading in this frame
+  uint16_t newAlerts;                 // outputs with a new alert to publish
+  uint16_t tripped;                   // outputs turned off by the sensor task
+  uint16_t restored;                  // outputs turned back on by the sensor task
+  uint32_t tripLatency_us;            // worst alert interrupt to relay off time
+};
+
+// Everything a sweep touches on the I2C bus (the caller holds any bus lock)
+class PduBus
+{
+  public:
+    // Single 16-bit INA260 register read, false if the sensor didn't respond
+    virtual bool readRegister(uint8_t ina, uint8_t reg, uint16_t * value) = 0;
+
+    // Relay state is kept in a shadow and written to the relays in one go
+    virtual bool isOutputOn(uint8_t output) = 0;
+    virtual void setOutput(uint8_t output, bool on) = 0;
+    virtual void writeOutputs() = 0;
+};
+
+template <uint8_t COUNT>
+class PduScanner
+{
+  public:
+    // Indexes of the INA260s found, so each sweep only visits fitted sensors
+    uint16_t inasFound;
+    uint8_t inaList[COUNT];
+    uint8_t inaListCount;
+
+    // Supply voltage is limited to 12V only - we set limits at +/-2V
+    uint32_t supplyVoltage_mV;
+    uint32_t supplyVoltageDelta_mV;
+
+    // Current limit is configurable for combined and individual outputs
+    uint32_t overCurrentLimit_mA;
+
+    // When over the combined limit, outputs are shed (lowest priority first) until
+    // back under it, then restored once there is this much headroom for long enough
+    uint32_t loadShedHysteresis_mA;
+    uint32_t loadShedRestore_ms;
+
+    // Current change between scans under which a sequenced output is considered
+    // settled - configurable via "powerOnSettleMilliAmps"
+    uint32_t sequenceSettle_mA;
+
+    // Adaptive scanning - configurable via "inaIdleScanInterval" (1 reads every
+    // output every scan)
+    uint8_t inaIdleScanInterval;
+
+    // Per-output protection and power-on settings (set by config)
+    protection_t protection[COUNT];
+    powerOn_t powerOn[COUNT];
+
+    // Everything below is owned by the sensor task
+
+    // Last alert type to prevent repeated alert events
+    uint8_t lastAlertType[COUNT];
+
+    // Adaptive scan state
+    uint32_t inaScanCount;
+    uint32_t scanHotUntil[COUNT];
+
+    // Outputs currently shed and when restore headroom was first seen
+    uint16_t shedOutputs;
+    uint32_t shedRestoreTime;
+
+    // Power-on sequencer state
+    uint16_t sequencePending;
+    int8_t sequenceOutput;
+    uint32_t sequenceTime;
+    int32_t sequenceLast_mA;
+    bool sequenceSeeded;
+
+    PduScanner(PduBus * bus) :
+      inasFound(0), inaListCount(0),
+      supplyVoltage_mV(12000L), supplyVoltageDelta_mV(2000L), overCurrentLimit_mA(10000L),
+      loadShedHysteresis_mA(1000L), loadShedRestore_ms(10000L), sequenceSettle_mA(50L), inaIdleScanInterval(1),
+      inaScanCount(0L), shedOutputs(0), shedRestoreTime(0L),
+      sequencePending(0), sequenceOutput(-1), sequenceTime(0L), sequenceLast_mA(0L), sequenceSeeded(false),
+      _bus(bus) {}
+
+    bool readSample(uint8_t ina, int32_t * mA, uint32_t * mV, uint32_t * mW)
+    {
+      uint16_t current, voltage;
+
+      // Only current and bus voltage are read, power is derived from them (the
+      // INA260 power register has a coarse 10mW resolution anyway)
+      if (!_bus->readRegister(ina, INA_REG_CURRENT, &current))
+        return false;
+      if (!_bus->readRegister(ina, INA_REG_BUSVOLTAGE, &voltage))
+        return false;
+
+      *mA = ((int32_t)(int16_t)current * INA260_CURRENT_LSB_UA) / 1000L;
+      *mV = ((uint32_t)voltage * INA260_VOLTAGE_LSB_UV) / 1000L;
+      *mW = ((uint32_t)(*mA < 0 ? -*mA : *mA) * *mV) / 1000L;
+      return true;
+    }
+
+    bool isScanDue(uint8_t ina, uint32_t timestamp)
+    {
+      if (inaIdleScanInterval <= 1)
+        return true;
+
+      // Hot outputs every scan, including through their inrush window
+      protection_t * p = &protection[ina];
+      if (_bus->isOutputOn(ina) && (timestamp - p->onTime) < ((uint32_t)p->inrushTime_ms + SCAN_HOT_HOLD_MS))
+        return true;
+
+      if ((int32_t)(scanHotUntil[ina] - timestamp) > 0)
+        return true;
+
+      // Idle (and off) outputs every few scans, staggered to spread the bus load
+      return (inaScanCount % inaIdleScanInterval) == (ina % inaIdleScanInterval);
+    }
+
+    int checkVoltageLimits(uint32_t mV)
+    {
+      uint32_t underLimit_mV = supplyVoltage_mV - supplyVoltageDelta_mV;
+      uint32_t overLimit_mV = supplyVoltage_mV + supplyVoltageDelta_mV;
+
+      if (mV < underLimit_mV) { return -1; }
+      if (mV > overLimit_mV)  { return 1; }
+
+      return 0;
+    }
+
+    // A complete scan, the frame carries forward the last reading of any
+    // output not sampled this time
+    void sweep(PduFrame<COUNT> * frame)
+    {
+      int32_t mATotal = 0;
+
+      // Re-close any outputs due a retry after an over-current trip
+      checkRetries(frame);
+
+      // Iterate through each of the INA260s found on the I2C bus
+      for (uint8_t i = 0; i < inaListCount; i++)
+      {
+        uint8_t ina = inaList[i];
+
+        // Read the values for this sensor (if due, otherwise keep the last reading)
+        int32_t lastmA = frame->mA[ina];
+        if (isScanDue(ina, frame->timestamp) && readSample(ina, &frame->mA[ina], &frame->mV[ina], &frame->mW[ina]))
+        {
+          frame->sampled |= (1 << ina);
+
+          // Check against the output protection settings (grace periods etc)
+          frame->alertType[ina] = isOverCurrent(&protection[ina], frame->timestamp, frame->mA[ina]) ? ALERT_TYPE_I_OVER : ALERT_TYPE_NONE;
+
+          // Keep reading it every scan while near its limit or changing
+          updateScanHot(ina, frame->timestamp, lastmA, frame->mA[ina]);
+        }
+
+        // Keep track of total current
+        mATotal += frame->mA[ina];
+      }
+
+      // Check for any manual alert states
+      int32_t mAProjected = mATotal;
+      for (uint8_t i = 0; i < inaListCount; i++)
+      {
+        uint8_t ina = inaList[i];
+
+        if (!isSampled(frame, ina))
+          continue;
+
+        // Check bus voltage limits and set manual alert states if not already alerted
+        if (frame->alertType[ina] == ALERT_TYPE_NONE)
+        {
+          int voltageCheck = checkVoltageLimits(frame->mV[ina]);
+          if (voltageCheck < 0)
+          {
+            // Under-voltage alert
+            frame->alertType[ina] = ALERT_TYPE_V_UNDER;
+          }
+          else if (voltageCheck > 0)
+          {
+            // Over-voltage alert
+            frame->alertType[ina] = ALERT_TYPE_V_OVER;
+          }
+        }
+
+        // Alerted outputs are about to be shutdown so won't count towards the total
+        if (frame->alertType[ina] != ALERT_TYPE_NONE)
+        {
+          mAProjected -= frame->mA[ina];
+        }
+      }
+
+      // Shed outputs if over the total current limit, or restore them if not
+      uint16_t shed = 0;
+      if (mAProjected >= (int32_t)overCurrentLimit_mA)
+      {
+        // Total over-current alert
+        shed = shedLoad(frame, mAProjected);
+      }
+      else
+      {
+        restoreLoad(frame, mAProjected);
+
+        // Switch on the next output in the power-on sequence, if any
+        runSequence(frame, mAProjected);
+      }
+
+      // Check for any alerted outputs and shut them off
+      for (uint8_t i = 0; i < inaListCount; i++)
+      {
+        uint8_t ina = inaList[i];
+
+        // Any shed this scan may not have been sampled
+        if (!isSampled(frame, ina) && (shed & (1 << ina)) == 0)
+          continue;
+
+        // Check for any new alert states
+        if (frame->alertType[ina] != ALERT_TYPE_NONE && frame->alertType[ina] != lastAlertType[ina])
+        {
+          // Turn off relay if it is currently on, loop() publishes the event
+          if (_bus->isOutputOn(ina))
+          {
+            _bus->setOutput(ina, false);
+            frame->tripped |= (1 << ina);
+
+            // Over-current trips may be configured to retry
+            protection[ina].overload = 0LL;
+            if (frame->alertType[ina] == ALERT_TYPE_I_OVER)
+            {
+              scheduleRetry(&protection[ina], frame->timestamp);
+            }
+          }
+
+          // Flag an alert event for loop() to publish
+          frame->newAlerts |= (1 << ina);
+        }
+
+        // Update the *last alert type*
+        lastAlertType[ina] = frame->alertType[ina];
+      }
+
+      // Write any relay changes (trips, retries, load shedding, sequencing) in one go
+      _bus->writeOutputs();
+
+      inaScanCount++;
+    }
+
+  private:
+    PduBus * _bus;
+
+    static bool isSampled(PduFrame<COUNT> * frame, uint8_t ina)
+    {
+      return (frame->sampled >> ina) & 1;
+    }
+
+    void checkRetries(PduFrame<COUNT> * frame)
+    {
+      for (uint8_t i = 0; i < inaListCount; i++)
+      {
+        uint8_t ina = inaList[i];
+
+        protection_t * p = &protection[ina];
+
+        // Forget previous retries once the output has been healthy for a while
+        if (p->retryTime == 0L)
+        {
+          if (p->retries > 0 && (frame->timestamp - p->onTime) > RETRY_RESET_MS)
+          {
+            p->retries = 0;
+          }
+          continue;
+        }
+
+        if ((int32_t)(frame->timestamp - p->retryTime) < 0)
+          continue;
+
+        // Switch the output back on, loop() publishes the event
+        _bus->setOutput(ina, true);
+        frame->restored |= (1 << ina);
+
+        p->retries++;
+        p->retryTime = 0L;
+        p->onTime = frame->timestamp;
+        p->overload = 0LL;
+
+        lastAlertType[ina] = ALERT_TYPE_NONE;
+      }
+    }
+
+    void updateScanHot(uint8_t ina, uint32_t timestamp, int32_t lastmA, int32_t mA)
+    {
+      protection_t * p = &protection[ina];
+      int32_t absmA = mA < 0 ? -mA : mA;
+      int32_t step = mA - lastmA < 0 ? lastmA - mA : mA - lastmA;
+
+      if (p->overload > 0LL ||
+          absmA * 100L >= (int32_t)p->limit_mA * SCAN_HOT_PERCENT ||
+          step >= SCAN_TRANSIENT_MA)
+      {
+        scanHotUntil[ina] = timestamp + SCAN_HOT_HOLD_MS;
+      }
+    }
+
+    bool isLowerPriority(uint8_t ina, uint8_t than)
+    {
+      // Equal priorities are ranked by index, highest index is lowest priority
+      if (protection[ina].priority != protection[than].priority)
+        return protection[ina].priority < protection[than].priority;
+
+      return ina > than;
+    }
+
+    uint16_t shedLoad(PduFrame<COUNT> * frame, int32_t mATotal)
+    {
+      uint16_t shed = 0;
+
+      // Shed the lowest priority output still on, one at a time, using its
+      // last reading (carried forward if not sampled this scan) to project the
+      // total until back under the limit
+      while (mATotal >= (int32_t)overCurrentLimit_mA)
+      {
+        int8_t next = -1;
+        for (uint8_t i = 0; i < inaListCount; i++)
+        {
+          uint8_t ina = inaList[i];
+
+          if (!_bus->isOutputOn(ina) || (shedOutputs & (1 << ina)))
+            continue;
+
+          // Ignore any already being shutdown for their own alert (only current
+          // for outputs sampled this scan)
+          if (isSampled(frame, ina) && frame->alertType[ina] != ALERT_TYPE_NONE)
+            continue;
+
+          if (next == -1 || isLowerPriority(ina, next))
+          {
+            next = ina;
+          }
+        }
+
+        // Nothing left to shed
+        if (next == -1)
+          break;
+
+        frame->alertType[next] = ALERT_TYPE_I_OVER_TOTAL;
+        shedOutputs |= (1 << next);
+        shed |= (1 << next);
+        protection[next].shed_mA = frame->mA[next];
+
+        mATotal -= frame->mA[next];
+      }
+
+      shedRestoreTime = 0L;
+      return shed;
+    }
+
+    void restoreLoad(PduFrame<COUNT> * frame, int32_t mATotal)
+    {
+      if (shedOutputs == 0 || loadShedRestore_ms == 0)
+        return;
+
+      // Restore the highest priority shed output first
+      int8_t restore = -1;
+      for (uint8_t ina = 0; ina < COUNT; ina++)
+      {
+        if ((shedOutputs & (1 << ina)) == 0)
+          continue;
+
+        if (restore == -1 || isLowerPriority(restore, ina))
+        {
+          restore = ina;
+        }
+      }
+
+      // Wait until it would fit back under the limit with some headroom
+      protection_t * p = &protection[restore];
+      if (mATotal + p->shed_mA + (int32_t)loadShedHysteresis_mA >= (int32_t)overCurrentLimit_mA)
+      {
+        shedRestoreTime = 0L;
+        return;
+      }
+
+      // ...and stayed that way for long enough
+      if (shedRestoreTime == 0L)
+      {
+        shedRestoreTime = frame->timestamp;
+        return;
+      }
+
+      if ((frame->timestamp - shedRestoreTime) < loadShedRestore_ms)
+        return;
+
+      // Switch the output back on, loop() publishes the event
+      _bus->setOutput(restore, true);
+      frame->restored |= (1 << restore);
+      shedOutputs &= ~(1 << restore);
+
+      p->onTime = frame->timestamp;
+      p->overload = 0LL;
+      lastAlertType[restore] = ALERT_TYPE_NONE;
+
+      // Restart the timer for the next one
+      shedRestoreTime = frame->timestamp;
+    }
+
+    bool isSequencedBefore(uint8_t ina, uint8_t than)
+    {
+      // Equal orders are sequenced by index, lowest index first
+      if (powerOn[ina].order != powerOn[than].order)
+        return powerOn[ina].order < powerOn[than].order;
+
+      return ina < than;
+    }
+
+    bool isSequenceSettled(PduFrame<COUNT> * frame)
+    {
+      if (sequenceOutput == -1)
+        return true;
+
+      uint8_t output = sequenceOutput;
+
+      // Track its current from the first reading after it closed (anything
+      // carried forward in the frame was read before the relay moved)
+      int32_t delta = -1;
+      if (isSampled(frame, output))
+      {
+        if (sequenceSeeded)
+        {
+          delta = frame->mA[output] - sequenceLast_mA;
+          if (delta < 0) { delta = -delta; }
+        }
+
+        sequenceLast_mA = frame->mA[output];
+        sequenceSeeded = true;
+      }
+
+      // Always wait at least the configured delay
+      uint32_t elapsed = frame->timestamp - sequenceTime;
+      if (elapsed < powerOn[output].delay_ms)
+        return false;
+
+      // ...then for its current to stop moving between two readings (unless
+      // there is no sensor to tell us, or it is taking too long)
+      if (((inasFound >> output) & 1) && elapsed < SEQUENCE_SETTLE_TIMEOUT_MS)
+      {
+        if (delta < 0 || delta > (int32_t)sequenceSettle_mA)
+          return false;
+      }
+
+      sequenceOutput = -1;
+      return true;
+    }
+
+    void runSequence(PduFrame<COUNT> * frame, int32_t mATotal)
+    {
+      // Wait for the last output switched on to settle
+      if (!isSequenceSettled(frame) || sequencePending == 0)
+        return;
+
+      // Shed outputs get their headroom back first, and don't add load
+      // when already close to the limit
+      if (shedOutputs != 0 || mATotal + (int32_t)loadShedHysteresis_mA >= (int32_t)overCurrentLimit_mA)
+        return;
+
+      int8_t next = -1;
+      for (uint8_t ina = 0; ina < COUNT; ina++)
+      {
+        if ((sequencePending & (1 << ina)) == 0)
+          continue;
+
+        if (next == -1 || isSequencedBefore(ina, next))
+        {
+          next = ina;
+        }
+      }
+
+      sequencePending &= ~(1 << next);
+
+      // Switched on by some other means while waiting
+      if (_bus->isOutputOn(next))
+        return;
+
+      // Switch the output on, loop() publishes the event
+      _bus->setOutput(next, true);
+      frame->restored |= (1 << next);
+
+      protection_t * p = &protection[next];
+      p->onTime = frame->timestamp;
+      p->overload = 0LL;
+      p->retryTime = 0L;
+      p->retries = 0;
+      lastAlertType[next] = ALERT_TYPE_NONE;
+
+      // Read it every scan while it settles
+      scanHotUntil[next] = frame->timestamp + SCAN_HOT_HOLD_MS;
+
+      sequenceOutput = next;
+      sequenceTime = frame->timestamp;
+      sequenceSeeded = false;
+    }
+};
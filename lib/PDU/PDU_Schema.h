@@ -0,0 +1,297 @@
+/**
+  Config and command schemas for the OXRS BMD PDU firmware
+
+  The PDU's own properties, added to a document the firmware then hands to
+  the fan and Home Assistant libraries before passing it down to the Rack32
+  library. All titles, descriptions etc are string literals, so stay in
+  flash and are only referenced from the document. No hardware access, so
+  they can be built on the host (see test/ and "pio test -e native").
+*/
+#pragma once
+
+#include <stdint.h>
+#include <ArduinoJson.h>
+#include <PDU_Scanner.h>
+
+// Per-output config, an array of objects keyed by 1-based index
+inline void outputConfigSchema(JsonVariant json, uint8_t outputCount)
+{
+  JsonObject outputs = json["outputs"].to<JsonObject>();
+  outputs["title"] = "Output Configuration";
+  outputs["description"] = "Add configuration for each output on your device. The 1-based index specifies which output you wish to configure. An output will shutdown if the reading from the current sensor exceeds the over current limit (defaults to 2000mA or 2A, must be a number between 1 and 5000).";
+  outputs["type"] = "array";
+  
+  JsonObject items = outputs["items"].to<JsonObject>();
+  items["type"] = "object";
+
+  JsonObject properties = items["properties"].to<JsonObject>();
+
+  JsonObject index = properties["index"].to<JsonObject>();
+  index["title"] = "Index";
+  index["type"] = "integer";
+  index["minimum"] = 1;
+  index["maximum"] = outputCount;
+
+  JsonObject overCurrentLimitMilliAmps = properties["overCurrentLimitMilliAmps"].to<JsonObject>();
+  overCurrentLimitMilliAmps["title"] = "Over Current Limit (mA)";
+  overCurrentLimitMilliAmps["type"] = "integer";
+  overCurrentLimitMilliAmps["minimum"] = 1;
+  overCurrentLimitMilliAmps["maximum"] = 5000;
+
+  JsonObject instantTripMilliAmps = properties["instantTripMilliAmps"].to<JsonObject>();
+  instantTripMilliAmps["title"] = "Instant Trip Limit (mA)";
+  instantTripMilliAmps["description"] = "Shutdown immediately if the current exceeds this, regardless of any trip delay (defaults to the over current limit with no trip delay, otherwise 4 times the over current limit up to 15000). Must be a number between 1 and 15000.";
+  instantTripMilliAmps["type"] = "integer";
+  instantTripMilliAmps["minimum"] = 1;
+  instantTripMilliAmps["maximum"] = 15000;
+
+  JsonObject tripDelayMilliSeconds = properties["tripDelayMilliSeconds"].to<JsonObject>();
+  tripDelayMilliSeconds["title"] = "Trip Delay (ms)";
+  tripDelayMilliSeconds["description"] = "Time to shutdown when drawing twice the over current limit, smaller overloads take longer and larger ones trip sooner (defaults to 0, i.e. shutdown on the first reading over the limit). Must be a number between 0 and 60000.";
+  tripDelayMilliSeconds["type"] = "integer";
+  tripDelayMilliSeconds["minimum"] = 0;
+  tripDelayMilliSeconds["maximum"] = 60000;
+
+  JsonObject inrushMilliAmps = properties["inrushMilliAmps"].to<JsonObject>();
+  inrushMilliAmps["title"] = "Inrush Limit (mA)";
+  inrushMilliAmps["description"] = "Current allowed while an output is switching on (defaults to 0, i.e. no inrush allowance). Must be a number between 0 and 15000.";
+  inrushMilliAmps["type"] = "integer";
+  inrushMilliAmps["minimum"] = 0;
+  inrushMilliAmps["maximum"] = 15000;
+
+  JsonObject inrushMilliSeconds = properties["inrushMilliSeconds"].to<JsonObject>();
+  inrushMilliSeconds["title"] = "Inrush Time (ms)";
+  inrushMilliSeconds["description"] = "How long after switching on the inrush limit applies. Must be a number between 0 and 10000.";
+  inrushMilliSeconds["type"] = "integer";
+  inrushMilliSeconds["minimum"] = 0;
+  inrushMilliSeconds["maximum"] = 10000;
+
+  JsonObject retryCount = properties["retryCount"].to<JsonObject>();
+  retryCount["title"] = "Retry Count";
+  retryCount["description"] = "How many times to switch an output back on after an over current shutdown (defaults to 0, i.e. stay off). Must be a number between 0 and 10.";
+  retryCount["type"] = "integer";
+  retryCount["minimum"] = 0;
+  retryCount["maximum"] = 10;
+
+  JsonObject retryDelaySeconds = properties["retryDelaySeconds"].to<JsonObject>();
+  retryDelaySeconds["title"] = "Retry Delay (seconds)";
+  retryDelaySeconds["description"] = "Delay before the first retry, doubling for each subsequent retry (defaults to 5 seconds). Must be a number between 1 and 3600.";
+  retryDelaySeconds["type"] = "integer";
+  retryDelaySeconds["minimum"] = 1;
+  retryDelaySeconds["maximum"] = 3600;
+
+  JsonObject priority = properties["priority"].to<JsonObject>();
+  priority["title"] = "Priority";
+  priority["description"] = "When the combined over current limit is exceeded, outputs are shutdown lowest priority first (defaults to 0, equal priorities shutdown highest index first). Must be a number between 0 and 255.";
+  priority["type"] = "integer";
+  priority["minimum"] = 0;
+  priority["maximum"] = 255;
+
+  JsonObject powerOnState = properties["powerOnState"].to<JsonObject>();
+  powerOnState["title"] = "Power On State";
+  powerOnState["description"] = "State of the output when the PDU powers up, either the ‘last’ state it was commanded to (the default), or always ‘on’ or ‘off’.";
+  powerOnState["type"] = "string";
+  JsonArray powerOnStateEnum = powerOnState["enum"].to<JsonArray>();
+  powerOnStateEnum.add("last");
+  powerOnStateEnum.add("on");
+  powerOnStateEnum.add("off");
+
+  JsonObject powerOnOrder = properties["powerOnOrder"].to<JsonObject>();
+  powerOnOrder["title"] = "Power On Order";
+  powerOnOrder["description"] = "When powering up (unless the relays are already on at power up, i.e. NC relays), or switching several outputs on at once, outputs are switched on one at a time in ascending order (defaults to 0, equal orders switch on lowest index first). Must be a number between 0 and 255.";
+  powerOnOrder["type"] = "integer";
+  powerOnOrder["minimum"] = 0;
+  powerOnOrder["maximum"] = 255;
+
+  JsonObject powerOnDelayMilliSeconds = properties["powerOnDelayMilliSeconds"].to<JsonObject>();
+  powerOnDelayMilliSeconds["title"] = "Power On Delay (ms)";
+  powerOnDelayMilliSeconds["description"] = "Minimum time to wait after switching this output on before switching on the next, in addition to waiting for its current to settle (defaults to 0). Must be a number between 0 and 60000.";
+  powerOnDelayMilliSeconds["type"] = "integer";
+  powerOnDelayMilliSeconds["minimum"] = 0;
+  powerOnDelayMilliSeconds["maximum"] = 60000;
+
+  JsonArray required = items["required"].to<JsonArray>();
+  required.add("index");
+}
+
+// Everything the PDU itself is configured with (not the fan or HASS config)
+inline void pduConfigSchema(JsonVariant json, uint8_t outputCount)
+{
+  JsonObject publishPduTelemetrySeconds = json["publishPduTelemetrySeconds"].to<JsonObject>();
+  publishPduTelemetrySeconds["title"] = "Publish PDU Telemetry (seconds)";
+  publishPduTelemetrySeconds["description"] = "How often to publish telemetry data from the onboard INA260 current sensors (defaults to 60 seconds, setting to 0 disables telemetry reports). Must be a number between 0 and 86400 (i.e. 1 day).";
+  publishPduTelemetrySeconds["type"] = "integer";
+  publishPduTelemetrySeconds["minimum"] = 0;
+  publishPduTelemetrySeconds["maximum"] = 86400;
+
+  JsonObject publishPduTelemetryPerOutput = json["publishPduTelemetryPerOutput"].to<JsonObject>();
+  publishPduTelemetryPerOutput["title"] = "Publish PDU Telemetry Per Output";
+  publishPduTelemetryPerOutput["description"] = "Publish telemetry for each output on its own subtopic (i.e. <telemetry topic>/<index>) rather than as a single array (defaults to false). Home Assistant sensors then only update when their output does.";
+  publishPduTelemetryPerOutput["type"] = "boolean";
+
+  JsonObject publishPduTelemetryCompact = json["publishPduTelemetryCompact"].to<JsonObject>();
+  publishPduTelemetryCompact["title"] = "Publish PDU Telemetry Compact";
+  publishPduTelemetryCompact["description"] = "Publish the combined telemetry as arrays of values, one per field, instead of an object per output (defaults to false). Not used when publishing telemetry per output.";
+  publishPduTelemetryCompact["type"] = "boolean";
+
+  JsonObject publishPduTelemetryOnChange = json["publishPduTelemetryOnChange"].to<JsonObject>();
+  publishPduTelemetryOnChange["title"] = "Publish PDU Telemetry On Change";
+  publishPduTelemetryOnChange["description"] = "Publish telemetry for any output as soon as its readings change by more than the deadbands below (defaults to false). The periodic telemetry is still published as a heartbeat. Combined payloads then only include the outputs which changed, Home Assistant sensors keep their last value for the rest.";
+  publishPduTelemetryOnChange["type"] = "boolean";
+
+  JsonObject telemetryDeadbandMilliAmps = json["telemetryDeadbandMilliAmps"].to<JsonObject>();
+  telemetryDeadbandMilliAmps["title"] = "Telemetry Deadband (mA)";
+  telemetryDeadbandMilliAmps["description"] = "Minimum change in current to publish (defaults to 50mA). Must be a number between 0 and 15000.";
+  telemetryDeadbandMilliAmps["type"] = "integer";
+  telemetryDeadbandMilliAmps["minimum"] = 0;
+  telemetryDeadbandMilliAmps["maximum"] = 15000;
+
+  JsonObject telemetryDeadbandMilliVolts = json["telemetryDeadbandMilliVolts"].to<JsonObject>();
+  telemetryDeadbandMilliVolts["title"] = "Telemetry Deadband (mV)";
+  telemetryDeadbandMilliVolts["description"] = "Minimum change in bus voltage to publish (defaults to 100mV). Must be a number between 0 and 36000.";
+  telemetryDeadbandMilliVolts["type"] = "integer";
+  telemetryDeadbandMilliVolts["minimum"] = 0;
+  telemetryDeadbandMilliVolts["maximum"] = 36000;
+
+  JsonObject telemetryDeadbandMilliWatts = json["telemetryDeadbandMilliWatts"].to<JsonObject>();
+  telemetryDeadbandMilliWatts["title"] = "Telemetry Deadband (mW)";
+  telemetryDeadbandMilliWatts["description"] = "Minimum change in power to publish (defaults to 500mW). Must be a number between 0 and 500000.";
+  telemetryDeadbandMilliWatts["type"] = "integer";
+  telemetryDeadbandMilliWatts["minimum"] = 0;
+  telemetryDeadbandMilliWatts["maximum"] = 500000;
+
+  JsonObject telemetryDeadbandPercent = json["telemetryDeadbandPercent"].to<JsonObject>();
+  telemetryDeadbandPercent["title"] = "Telemetry Deadband (%)";
+  telemetryDeadbandPercent["description"] = "Minimum change relative to the last published value, used if larger than the absolute deadbands (defaults to 5%). Must be a number between 0 and 100.";
+  telemetryDeadbandPercent["type"] = "integer";
+  telemetryDeadbandPercent["minimum"] = 0;
+  telemetryDeadbandPercent["maximum"] = 100;
+
+  JsonObject telemetryMinIntervalMilliSeconds = json["telemetryMinIntervalMilliSeconds"].to<JsonObject>();
+  telemetryMinIntervalMilliSeconds["title"] = "Telemetry Minimum Interval (ms)";
+  telemetryMinIntervalMilliSeconds["description"] = "Minimum time between publishing changes (defaults to 0, i.e. publish on the next scan cycle). Must be a number between 0 and 60000.";
+  telemetryMinIntervalMilliSeconds["type"] = "integer";
+  telemetryMinIntervalMilliSeconds["minimum"] = 0;
+  telemetryMinIntervalMilliSeconds["maximum"] = 60000;
+
+  JsonObject overCurrentLimitMilliAmps = json["overCurrentLimitMilliAmps"].to<JsonObject>();
+  overCurrentLimitMilliAmps["title"] = "Over Current Limit (mA)";
+  overCurrentLimitMilliAmps["description"] = "If the readings from all current sensors add up to more than this limit then shutdown outputs, lowest priority first, until back under the limit (defaults to 10000mA or 10A). Must be a number between 1 and 15000 (i.e. 15A).";
+  overCurrentLimitMilliAmps["type"] = "integer";
+  overCurrentLimitMilliAmps["minimum"] = 1;
+  overCurrentLimitMilliAmps["maximum"] = 15000;
+
+  JsonObject loadShedHysteresisMilliAmps = json["loadShedHysteresisMilliAmps"].to<JsonObject>();
+  loadShedHysteresisMilliAmps["title"] = "Load Shed Hysteresis (mA)";
+  loadShedHysteresisMilliAmps["description"] = "Headroom required under the over current limit before a shed output is switched back on (defaults to 1000mA or 1A). Must be a number between 0 and 15000.";
+  loadShedHysteresisMilliAmps["type"] = "integer";
+  loadShedHysteresisMilliAmps["minimum"] = 0;
+  loadShedHysteresisMilliAmps["maximum"] = 15000;
+
+  JsonObject loadShedRestoreSeconds = json["loadShedRestoreSeconds"].to<JsonObject>();
+  loadShedRestoreSeconds["title"] = "Load Shed Restore (seconds)";
+  loadShedRestoreSeconds["description"] = "How long there must be enough headroom before each shed output is switched back on, highest priority first (defaults to 10 seconds, setting to 0 leaves shed outputs off). Must be a number between 0 and 3600.";
+  loadShedRestoreSeconds["type"] = "integer";
+  loadShedRestoreSeconds["minimum"] = 0;
+  loadShedRestoreSeconds["maximum"] = 3600;
+
+  JsonObject powerOnSettleMilliAmps = json["powerOnSettleMilliAmps"].to<JsonObject>();
+  powerOnSettleMilliAmps["title"] = "Power On Settle (mA)";
+  powerOnSettleMilliAmps["description"] = "When switching outputs on one at a time, the next output is switched on once the current of the last changes by less than this between readings (defaults to 50mA, or after 2 seconds regardless). Must be a number between 1 and 1000.";
+  powerOnSettleMilliAmps["type"] = "integer";
+  powerOnSettleMilliAmps["minimum"] = 1;
+  powerOnSettleMilliAmps["maximum"] = 1000;
+
+  JsonObject inaAveragingCount = json["inaAveragingCount"].to<JsonObject>();
+  inaAveragingCount["title"] = "Current Sensor Averaging (samples)";
+  inaAveragingCount["description"] = "Number of samples each INA260 averages per reading (defaults to 16). The scan period is derived from this and the conversion time (2 x samples x conversion time, plus a margin, between 10ms and 1s).";
+  inaAveragingCount["type"] = "integer";
+  JsonArray inaAveragingCountEnum = inaAveragingCount["enum"].to<JsonArray>();
+  for (uint16_t count : INA_AVERAGING_COUNTS)
+  {
+    inaAveragingCountEnum.add(count);
+  }
+
+  JsonObject inaConversionTimeMicroSeconds = json["inaConversionTimeMicroSeconds"].to<JsonObject>();
+  inaConversionTimeMicroSeconds["title"] = "Current Sensor Conversion Time (us)";
+  inaConversionTimeMicroSeconds["description"] = "Time each INA260 takes to convert a current or bus voltage sample (defaults to 1100us).";
+  inaConversionTimeMicroSeconds["type"] = "integer";
+  JsonArray inaConversionTimeEnum = inaConversionTimeMicroSeconds["enum"].to<JsonArray>();
+  for (uint16_t time : INA_CONVERSION_TIMES_US)
+  {
+    inaConversionTimeEnum.add(time);
+  }
+
+  JsonObject inaIdleScanInterval = json["inaIdleScanInterval"].to<JsonObject>();
+  inaIdleScanInterval["title"] = "Idle Output Scan Interval (scans)";
+  inaIdleScanInterval["description"] = "Read idle or switched off outputs only every this many scans, while outputs recently switched on, near their limit or changing are still read every scan (defaults to 1, i.e. read every output every scan). Must be a number between 1 and 16.";
+  inaIdleScanInterval["type"] = "integer";
+  inaIdleScanInterval["minimum"] = 1;
+  inaIdleScanInterval["maximum"] = 16;
+
+  outputConfigSchema(json, outputCount);
+
+  JsonObject hassDiscoveryEntitiesPerLoop = json["hassDiscoveryEntitiesPerLoop"].to<JsonObject>();
+  hassDiscoveryEntitiesPerLoop["title"] = "Home Assistant Discovery Rate (entities per loop)";
+  hassDiscoveryEntitiesPerLoop["description"] = "How many Home Assistant discovery configs to publish each time round the main loop, so discovery doesn't flood the broker on connect (defaults to 2). Must be a number between 1 and 80.";
+  hassDiscoveryEntitiesPerLoop["type"] = "integer";
+  hassDiscoveryEntitiesPerLoop["minimum"] = 1;
+  hassDiscoveryEntitiesPerLoop["maximum"] = 80;
+}
+
+// Per-output commands, an array of objects keyed by 1-based index
+inline void outputCommandSchema(JsonVariant json, uint8_t outputCount)
+{
+  JsonObject outputs = json["outputs"].to<JsonObject>();
+  outputs["title"] = "Output Commands";
+  outputs["description"] = "Send commands to one or more outputs on your device. The 1-based index specifies which output you wish to command. Supported commands are ‘on’ or ‘off’ to change the output state, ‘query’ to publish the current state to MQTT, ‘resetEnergy’ to zero the energy counter, or ‘capture’ to record a high-rate current/voltage waveform and publish it to the ‘capture’ telemetry subtopic (‘captureInrush’ also switches the output on once recording).";
+  outputs["type"] = "array";
+  
+  JsonObject items = outputs["items"].to<JsonObject>();
+  items["type"] = "object";
+
+  JsonObject properties = items["properties"].to<JsonObject>();
+
+  JsonObject index = properties["index"].to<JsonObject>();
+  index["title"] = "Index";
+  index["type"] = "integer";
+  index["minimum"] = 1;
+  index["maximum"] = outputCount;
+
+  JsonObject command = properties["command"].to<JsonObject>();
+  command["title"] = "Command";
+  command["type"] = "string";
+  JsonArray commandEnum = command["enum"].to<JsonArray>();
+  commandEnum.add("query");
+  commandEnum.add("on");
+  commandEnum.add("off");
+  commandEnum.add("resetEnergy");
+  commandEnum.add("capture");
+  commandEnum.add("captureInrush");
+
+  JsonArray required = items["required"].to<JsonArray>();
+  required.add("index");
+  required.add("command");
+}
+
+// Everything the PDU itself can be commanded to do (not the fan commands)
+inline void pduCommandSchema(JsonVariant json, uint8_t outputCount)
+{
+  JsonObject queryOutputs = json["queryOutputs"].to<JsonObject>();
+  queryOutputs["title"] = "Query Outputs";
+  queryOutputs["description"] = "Query and publish the state of all outputs.";
+  queryOutputs["type"] = "boolean";
+
+  JsonObject queryEnergy = json["queryEnergy"].to<JsonObject>();
+  queryEnergy["title"] = "Query Energy";
+  queryEnergy["description"] = "Query and publish the energy counters (in mWh) for all outputs.";
+  queryEnergy["type"] = "boolean";
+
+  JsonObject queryDiagnostics = json["queryDiagnostics"].to<JsonObject>();
+  queryDiagnostics["title"] = "Query Diagnostics";
+  queryDiagnostics["description"] = "Query and publish diagnostic counters (publish queue depth, drops, stage latency histograms, I2C bus counters, heap low-water marks etc). Also available from the REST API at /diagnostics.";
+  queryDiagnostics["type"] = "boolean";
+
+  // Add the output commands
+  outputCommandSchema(json, outputCount);
+}
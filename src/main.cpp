@@ -20,6 +20,16 @@
 #include <OXRS_Output.h>              // For output handling
 #include <OXRS_Fan.h>                 // For fan control
 #include <OXRS_HASS.h>                // For Home Assistant self-discovery
+#include <atomic>                     // For lock-free sensor task hand-off
+#include <Preferences.h>              // For persisting energy counters
+#include <esp_heap_caps.h>            // For heap fragmentation diagnostics
+#include <esp_system.h>               // For checkpointing energy on restart
+#include <PDU_Protection.h>           // For per-output over-current protection
+#include <PDU_FrameRing.h>            // For the sensor task to loop() hand-off
+#include <PDU_PublishQueue.h>         // For the outbound status event queue
+#include <PDU_Scanner.h>              // For the sensor scan, shedding and sequencing
+#include <PDU_JsonArena.h>            // For heap-free JSON documents
+#include <PDU_Schema.h>               // For the config and command schemas
 
 #if defined(OXRS_RACK32)
 #include <OXRS_Rack32.h>              // Rack32 support
@@ -33,13 +43,22 @@ OXRS_Black oxrs;
 // Serial
 #define       SERIAL_BAUD_RATE        115200
 
-// INA260 setup (should we make this configurable?)
+// INA260 setup (configurable via "inaAveragingCount" and "inaConversionTimeMicroSeconds")
 const INA260_AveragingCount DEFAULT_AVERAGING_COUNT = INA260_COUNT_16;
 const INA260_ConversionTime DEFAULT_CONVERSION_TIME = INA260_TIME_1_1_ms;
 
+// Board profile, selected per env in platformio.ini via build flags;
+//  PDU_PORT_COUNT    number of ports fitted (defaults to 16, INA260s from 0x40)
+//  PDU_RELAYS_NO     relays are normally open (defaults to normally closed)
+#if !defined(PDU_PORT_COUNT)
+#define       PDU_PORT_COUNT          16
+#endif
+
 // Can have up to 16x INA260s on a single I2C bus
 const byte    INA_I2C_ADDRESS[]     = { 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F };
-const uint8_t INA_COUNT             = sizeof(INA_I2C_ADDRESS);
+const uint8_t INA_COUNT             = PDU_PORT_COUNT;
+
+static_assert(INA_COUNT > 0 && INA_COUNT <= sizeof(INA_I2C_ADDRESS), "PDU_PORT_COUNT must be between 1 and 16");
 
 // Define the MCP addresses
 const byte    MCP_I2C_ADDRESS[]     = { 0x20, 0x21 };
@@ -51,26 +70,146 @@ const uint8_t MCP_COUNT             = sizeof(MCP_I2C_ADDRESS);
 // Each MCP23017 has 16 I/O pins
 #define       MCP_PIN_COUNT           16
 
+// Output MCP level which turns a relay on, and the state the relays power up
+// in (i.e. with the output MCP pins low, the relays de-energised)
+#if defined(PDU_RELAYS_NO)
+#define       RELAY_ON_LEVEL          1
+#define       RELAY_POWER_ON_STATE    RELAY_OFF
+#else
+#define       RELAY_ON_LEVEL          0
+#define       RELAY_POWER_ON_STATE    RELAY_ON
+#endif
+
+// GPIO wired to the (mirrored, active low) input MCP23017 INTA/INTB lines -
+// define MCP_INPUT_INT_PIN in the build flags to only read the input MCP when
+// it flags a change, with a slow safety poll in case an edge is ever missed
+// (without it the inputs are read at a fixed rate, well inside the input
+// handler debounce, rather than on every loop)
+#define       MCP_INPUT_POLL_MS       100L
+#define       MCP_INPUT_SCAN_MS       5L
+
 // Speed up the I2C bus to get faster event handling
 #define       I2C_CLOCK_SPEED         400000L
 
+// Give up on any I2C transaction after this long (missing devices NACK, this
+// only bounds a wedged bus - the ESP32 default is 50ms)
+#define       I2C_TIMEOUT_MS          10
+
 // Default maximum mA for each output (configurable via "overCurrentLimitMilliAmps")
 #define       DEFAULT_OVERCURRENT_MA  2000L
 
-// Cycle time to read INAs (INA260_TIME_x * INA260_COUNT_x * 2 + margin)
-// set to 40ms (25Hz scan frequency)
-#define       INA_CYCLE_TIME          40L
+// INA260 mask/enable flags (scaling and registers are in PDU_Scanner.h)
+#define       INA260_MASK_ENABLE_AFF  0x0010
+#define       INA260_MASK_ENABLE_CVRF 0x0008
 
-// Alert types
-#define       ALERT_TYPE_NONE         0
-#define       ALERT_TYPE_V_OVER       1
-#define       ALERT_TYPE_V_UNDER      2
-#define       ALERT_TYPE_I_OVER       3
-#define       ALERT_TYPE_I_OVER_TOTAL 4
+// Cycle time to read INAs (INA260_TIME_x * INA260_COUNT_x * 2 + margin)
+// defaults to 40ms (25Hz scan frequency), derived from the INA260 config
+#define       INA_CYCLE_MARGIN        5L
+#define       INA_MIN_CYCLE_TIME      10L
+#define       INA_MAX_CYCLE_TIME      1000L
+
+// Sensor task is pinned to the core not running loop() so network activity
+// (MQTT reconnects, discovery bursts etc) can never delay protection
+#define       SENSOR_TASK_CORE        0
+#define       SENSOR_TASK_PRIORITY    (configMAX_PRIORITIES - 2)
+#define       SENSOR_TASK_STACK_SIZE  4096
+
+// GPIO wired to the (open-drain, active low) INA260 ALERT lines - define
+// INA_ALERT_PIN in the build flags to trip outputs from the alert interrupt
+// rather than waiting for the next scan cycle (without it the alert flag of
+// any output which is on, but not due a reading from adaptive scanning, is
+// polled at the start of each scan instead - one extra register read each)
+
+// Number of sample frames buffered between the sensor task and loop() (must be a power of 2)
+#define       INA_FRAME_COUNT         16
+
+// Energy counters are checkpointed to NVS in a single write for all outputs,
+// at most this often (NVS spreads writes across its pages for wear levelling),
+// or sooner (but no more often than the minimum) once any output has changed
+// state, and always on a software restart (OTA update or restart command) -
+// so a power cut, brownout, panic or watchdog reset loses at most
+// ENERGY_CHECKPOINT_MS of energy under a steady load
+#define       ENERGY_CHECKPOINT_MS    900000L
+#define       ENERGY_CHECKPOINT_MIN_MS 60000L
+
+// Conversion from our internal energy unit (mW x ms) to mWh
+#define       ENERGY_MWMS_PER_MWH     3600000LL
+
+// Commanded relay states are journalled to NVS once they have been stable
+// this long, so a burst of commands costs a single write
+#define       RELAY_STATE_WRITE_MS    2000L
+
+// Status events queued for publishing, and how many to publish per loop - alerts
+// are never dropped, so there is room for every alert type on every output
+// (only repeats of the same alert are merged) plus a burst of relay events
+#define       PUBLISH_QUEUE_SIZE      (INA_COUNT * ALERT_TYPE_I_OVER_TOTAL + 16)
+#define       PUBLISH_QUEUE_BURST     4
+
+// Wait this long before retrying after a failed publish (e.g. broker down)
+#define       PUBLISH_RETRY_MS        1000L
+
+// Waveform capture of a single output, read at minimum averaging and conversion
+// time (a new reading every ~280us) between scans, stopping this long before the
+// next scan is due so lower priority tasks on the same core still get to run
+#define       CAPTURE_SAMPLE_COUNT    512
+#define       CAPTURE_CHUNK_SIZE      64
+#define       CAPTURE_TIMEOUT_MS      2000L
+#define       CAPTURE_SCAN_MARGIN_MS  2L
+
+// Capture polls for a new reading no more than once per conversion, waiting out
+// the rest of it (and always at least the gap) without the I2C lock, so loop()
+// can still get on the bus
+#define       CAPTURE_POLL_US         280L
+#define       CAPTURE_POLL_GAP_US     50L
+
+// Waveform capture states
+#define       CAPTURE_IDLE            0
+#define       CAPTURE_REQUESTED       1
+#define       CAPTURE_RUNNING         2
+#define       CAPTURE_COMPLETE        3
+
+// Flight recorder keeps the last few scans of every output and freezes the
+// scans either side of any alert, published to the "recorder" telemetry subtopic
+#define       RECORDER_PRE_SAMPLES    24
+#define       RECORDER_POST_SAMPLES   8
+#define       RECORDER_SAMPLE_COUNT   (RECORDER_PRE_SAMPLES + RECORDER_POST_SAMPLES)
+
+// Static arenas backing our JSON documents, so building and publishing payloads
+// never touches the heap (ArduinoJson allocates 4KB variant pools on the ESP32,
+// plus any copied strings) - the scratch arena is shared by every document built
+// and published within a single call (status events, discovery, REST etc) and
+// is sized for the largest of those, the config schema built at boot
+#define       JSON_ARENA_PDU_SIZE     12288
+#define       JSON_ARENA_SLOT_SIZE    6144
+#define       JSON_ARENA_SCRATCH_SIZE 12288
+
+// Stages timed for the diagnostics latency histograms
+#define       STAGE_OXRS_LOOP         0
+#define       STAGE_PROCESS_INAS      1
+#define       STAGE_PROCESS_MCPS      2
+#define       STAGE_PROCESS_FANS      3
+#define       STAGE_HASS_DISCOVERY    4
+#define       STAGE_PUBLISH_QUEUE     5
+#define       STAGE_SENSOR_SCAN       6
+#define       STAGE_COUNT             7
+
+const char *  STAGE_NAMES[]         = { "oxrsLoop", "processInas", "processMcps", "processFans", "hassDiscovery", "publishQueue", "sensorScan" };
+
+// Latency histogram bucket upper bounds (us), anything slower lands in the last bucket
+const uint32_t STAGE_BUCKET_US[]    = { 100, 1000, 10000, 100000 };
+const uint8_t STAGE_BUCKET_COUNT    = sizeof(STAGE_BUCKET_US) / sizeof(STAGE_BUCKET_US[0]) + 1;
+
+// Telemetry payloads waiting to be published, a newer payload supersedes
+// any still pending in the same slot
+#define       TELEMETRY_SLOT_PDU      0
+#define       TELEMETRY_SLOT_ENERGY   1
+#define       TELEMETRY_SLOT_FAN      2
+#define       TELEMETRY_SLOT_DIAG     3
+#define       TELEMETRY_SLOT_COUNT    4
 
 /*--------------------------- Global Variables ------------------------*/
-// Each bit corresponds to a device found on the IC2 bus
-uint8_t g_inasFound = 0;
+// Each bit corresponds to a device found on the IC2 bus (the INA260s found
+// are kept by the scanner, see g_scanner.inasFound and g_scanner.inaList)
 uint8_t g_mcpsFound = 0;
 
 // Publish telemetry data interval - extend or disable via the config
@@ -78,24 +217,270 @@ uint8_t g_mcpsFound = 0;
 uint32_t g_publishTelemetry_ms      = 60000L;
 uint32_t g_lastPublishTelemetry     = 0L;
 
-// Supply voltage is limited to 12V only - we set limits at +/-2V
-uint32_t g_supplyVoltage_mV         = 12000L;
-uint32_t g_supplyVoltageDelta_mV    = 2000L;
+// Publish telemetry for each output on its own subtopic (<telemetry topic>/<index>)
+// instead of a single array - configurable via "publishPduTelemetryPerOutput"
+bool g_publishTelemetryPerOutput    = false;
+uint8_t g_telemetryPerOutputNext    = 0;
+
+// Publish the combined telemetry as columns of integers, rather than an
+// array of objects - configurable via "publishPduTelemetryCompact"
+//
+// Compact telemetry payload (one column per field, every column the
+// same length, entry n of each column describes output index[n]);
+//
+//   {
+//     "index":  [1, 2, ...],           output index (1-based)
+//     "mA":     [...], "mV": [...], "mW": [...], "mWh": [...],
+//     "samples":[...],                 readings in the statistics window
+//     "mAMin":  [...], "mAMax": [...], "mAAvg": [...], "mARms": [...],
+//     "mVMin":  [...], "mVMax": [...], "mVAvg": [...],
+//     "mWMax":  [...], "mWAvg": [...]
+//   }
+//
+// Statistics columns are zero where "samples" is zero. Collectors decode
+// it by zipping the columns back together, i.e. output index[n] has
+// mA[n], mV[n] etc. Not used when publishing per output.
+bool g_publishTelemetryCompact      = false;
+
+// Report-by-exception, publish outputs whose readings move outside a deadband
+// (absolute or relative to the last published value) as soon as they change,
+// no more often than the minimum interval - configurable via 
+// "publishPduTelemetryOnChange" etc (the periodic publish becomes a heartbeat)
+bool g_publishTelemetryOnChange     = false;
+uint32_t g_telemetryDeadband_mA     = 50L;
+uint32_t g_telemetryDeadband_mV     = 100L;
+uint32_t g_telemetryDeadband_mW     = 500L;
+uint32_t g_telemetryDeadbandPercent = 5L;
+uint32_t g_telemetryMinInterval_ms  = 0L;
+uint32_t g_lastPublishTelemetryChange = 0L;
+
+// Outputs changed since last published, and those in the pending telemetry payload
+uint16_t g_telemetryChanged         = 0;
+uint16_t g_telemetryOutputs         = 0;
+
+// Last readings published for each output
+int32_t g_publishedmA[INA_COUNT];
+uint32_t g_publishedmV[INA_COUNT];
+uint32_t g_publishedmW[INA_COUNT];
+
+// INA260 register and relay access for the scanner, over the I2C bus (the
+// sensor task holds the I2C lock for the whole scan)
+class WirePduBus : public PduBus
+{
+  public:
+    bool readRegister(uint8_t ina, uint8_t reg, uint16_t * value) override;
+    bool isOutputOn(uint8_t output) override;
+    void setOutput(uint8_t output, bool on) override;
+    void writeOutputs() override;
+};
+
+// Sensor scan - protection, load shedding and the power-on sequencer. Its
+// settings are set by config, everything else is owned by the sensor task
+WirePduBus g_pduBus;
+PduScanner<INA_COUNT> g_scanner(&g_pduBus);
+
+// Outputs whose *last alert type* needs clearing, set by loop() and consumed
+// by the sensor task so any subsequent alert triggers
+std::atomic<uint16_t> g_alertRearm(0);
 
-// Current limit is configurable for combined and individual outputs
-uint32_t g_overCurrentLimit_mA      = 10000L;
+// Outputs switched on by loop(), so the sensor task can start their inrush window
+std::atomic<uint16_t> g_outputsSwitchedOn(0);
 
-// Timer for INA scan cycle timing
-uint32_t g_inaTimer                 = 0L;
+// INA260 averaging/conversion, set by config and applied by the sensor task
+INA260_AveragingCount g_inaAveragingCount = DEFAULT_AVERAGING_COUNT;
+INA260_ConversionTime g_inaConversionTime = DEFAULT_CONVERSION_TIME;
+std::atomic<bool> g_inaConversionChanged(false);
 
-// Last alert type to prevent repeated alert events
-uint8_t g_lastAlertType[INA_COUNT];
+// Scan period, derived from the INA260 config
+uint32_t g_inaCycleTime_ms          = 40L;
 
 // Query current state of outputs
 bool g_queryOutputs = false;
 
-// Publish Home Assistant self-discovery config for each output
-bool g_hassDiscoveryPublished[INA_COUNT];
+// Last value read from the input MCP (pulled up, so HIGH when idle)
+uint16_t g_inputValue               = 0xFFFF;
+uint32_t g_lastInputRead            = 0L;
+uint32_t g_inputReads               = 0L;
+
+// Query and publish the energy counters
+bool g_queryEnergy = false;
+
+// Query and publish the diagnostic counters
+bool g_queryDiagnostics = false;
+
+// Bounded outbound queue of status events (type is RELAY or ALERT_EVENT),
+// drained by loop() and replayed after a failure
+StatusEventQueue<PUBLISH_QUEUE_SIZE> g_publishQueue;
+PublishBackoff g_publishBackoff(PUBLISH_RETRY_MS);
+
+bool g_telemetryPending[TELEMETRY_SLOT_COUNT];
+uint32_t g_telemetrySuperseded      = 0L;
+
+// Energy used by each output (in mW x ms), integrated from every sample
+uint64_t g_outputEnergy[INA_COUNT];
+uint32_t g_outputEnergyLastSample[INA_COUNT];
+uint32_t g_outputEnergyLast_mW[INA_COUNT];
+
+// Energy checkpoint timer, whether any counters have changed since and
+// whether any output has changed state since
+uint32_t g_lastEnergyCheckpoint     = 0L;
+bool g_energyDirty                  = false;
+bool g_energyCheckpointDue          = false;
+
+// Home Assistant self-discovery entities for each output
+#define       HASS_ENTITY_SWITCH      0
+#define       HASS_ENTITY_MA          1
+#define       HASS_ENTITY_MV          2
+#define       HASS_ENTITY_MW          3
+#define       HASS_ENTITY_ALERT       4
+#define       HASS_ENTITY_COUNT       5
+
+// Bits for the telemetry sensor entities (re-published if their topics change)
+#define       HASS_TELEMETRY_ENTITIES 0x0E
+
+// Publish Home Assistant self-discovery config for each output entity (one bit
+// per entity), paced to a few entities per loop - configurable via 
+// "hassDiscoveryEntitiesPerLoop"
+uint8_t g_hassDiscoveryPublished[INA_COUNT];
+uint8_t g_hassDiscoveryPerLoop      = 2;
+uint16_t g_hassDiscoveryCount       = 0;
+uint32_t g_hassDiscoveryStart       = 0L;
+
+// A single sensor scan, handed from the sensor task to loop()
+typedef PduFrame<INA_COUNT> inaFrame_t;
+
+// Running statistics for each output over the current telemetry window
+typedef struct
+{
+  uint32_t samples;
+  int32_t mAMin;
+  int32_t mAMax;
+  int64_t mASum;
+  uint64_t mASumSquares;
+  uint32_t mVMin;
+  uint32_t mVMax;
+  uint64_t mVSum;
+  uint32_t mWMax;
+  uint64_t mWSum;
+} outputStats_t;
+
+outputStats_t g_outputStats[INA_COUNT];
+
+// Single-producer (sensor task) / single-consumer (loop) frame ring
+FrameRing<inaFrame_t, INA_FRAME_COUNT> g_inaFrames;
+uint32_t g_inaFramesDropped         = 0L;
+
+// Alerts and trips not yet handed to loop() (owned by the sensor task)
+uint16_t g_unsentAlerts             = 0;
+uint16_t g_unsentTrips              = 0;
+uint16_t g_unsentRestores           = 0;
+uint8_t g_unsentAlertType[INA_COUNT];
+uint32_t g_unsentTripLatency_us     = 0L;
+
+// Time the INA260 alert interrupt fired and the trip latency stats
+volatile uint32_t g_inaAlertTime_us = 0L;
+uint32_t g_tripLatencyLast_us       = 0L;
+uint32_t g_tripLatencyMax_us        = 0L;
+
+// Waveform capture sample (raw register values, scaled when published)
+typedef struct
+{
+  uint32_t time_us;                   // since the capture started
+  int16_t current;
+  uint16_t voltage;
+} captureSample_t;
+
+// Waveform capture, requested by loop(), run by the sensor task and handed
+// back to loop() to publish in chunks once complete
+captureSample_t g_captureSamples[CAPTURE_SAMPLE_COUNT];
+std::atomic<uint8_t> g_captureState(CAPTURE_IDLE);
+uint8_t g_captureIna                = 0;
+uint16_t g_captureCount             = 0;
+uint32_t g_captureStart             = 0L;
+uint32_t g_captureStart_us          = 0L;
+
+// Switch the output on once the capture is running (owned by loop)
+bool g_captureInrush                = false;
+uint16_t g_captureChunk             = 0;
+
+// Flight recorder history, oldest scan first once frozen
+typedef struct
+{
+  uint32_t timestamp[RECORDER_SAMPLE_COUNT];
+  int16_t mA[RECORDER_SAMPLE_COUNT][INA_COUNT];
+  uint16_t mV[RECORDER_SAMPLE_COUNT][INA_COUNT];
+} recorderHistory_t;
+
+// Rolling history and trigger state (owned by the sensor task)
+recorderHistory_t g_recorder;
+uint32_t g_recorderHead             = 0L;
+uint16_t g_recorderTriggered        = 0;
+uint8_t g_recorderPostSamples       = 0;
+uint16_t g_recorderInterruptTrips   = 0;
+uint32_t g_recorderMissed           = 0L;
+
+// Frozen snapshot, handed to loop() to publish (one output at a time)
+recorderHistory_t g_recorderSnapshot;
+std::atomic<uint16_t> g_recorderOutputs(0);
+uint32_t g_recorderTriggerTime      = 0L;
+uint8_t g_recorderSamples           = 0;
+uint8_t g_recorderAlertType[INA_COUNT];
+
+// Latency histogram for each timed stage (the sensor scan is updated by the
+// sensor task, everything else by loop)
+typedef struct
+{
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t total_us;
+  uint32_t buckets[STAGE_BUCKET_COUNT];
+} stageStats_t;
+
+stageStats_t g_stageStats[STAGE_COUNT];
+
+// I2C transaction counters for each device (errors include NACKs)
+typedef struct
+{
+  uint32_t transactions;
+  uint32_t errors;
+  uint32_t nacks;
+} i2cStats_t;
+
+i2cStats_t g_inaI2cStats[INA_COUNT];
+i2cStats_t g_mcpI2cStats[MCP_COUNT];
+
+// Scans which started a whole cycle or more late (owned by the sensor task)
+uint32_t g_inaScansMissed           = 0L;
+
+// Boot phase timings (ms since power on, zero until reached) and whether the
+// boot diagnostics have been queued for publishing yet
+uint32_t g_bootRelays_ms            = 0L;
+uint32_t g_bootSensors_ms           = 0L;
+uint32_t g_bootFirstSample_ms       = 0L;
+uint32_t g_bootNetwork_ms           = 0L;
+uint32_t g_bootFirstPublish_ms      = 0L;
+bool g_bootReportQueued             = false;
+
+// Relay state last commanded for each output (set bit is on), journalled to
+// NVS and restored at boot according to each output's power-on state
+uint16_t g_relayCommanded           = 0;
+bool g_relayCommandedDirty          = false;
+uint32_t g_relayCommandedChanged    = 0L;
+
+// Outputs queued for the power-on sequencer, and those switched by loop() since
+// (which drops them from the queue), consumed by the sensor task
+std::atomic<uint16_t> g_sequenceRequested(0);
+std::atomic<uint16_t> g_sequenceCancelled(0);
+
+// Shadow of the output MCP GPIO register, so relay state is read from RAM and
+// changes are written in a single transaction per batch (guarded by the I2C lock)
+// NOTE: bits are relay coils, so a clear bit (LOW) is on for NC relays, off for NO
+uint16_t g_outputShadow             = 0;
+bool g_outputShadowDirty            = false;
+
+// Sensor task handle and I2C bus lock (shared between the sensor task and loop)
+TaskHandle_t g_sensorTask           = NULL;
+SemaphoreHandle_t g_i2cMutex        = NULL;
 
 /*--------------------------- Instantiate Globals ---------------------*/
 // Current sensors
@@ -114,12 +499,88 @@ OXRS_Fan fan;
 // Home Assistant self-discovery
 OXRS_HASS hass(oxrs.getMQTT());
 
-// TODO: need an internal datatype to store per-port limits and alert timers
-//       so we can detect when we alert and not start shutting things down
-//       till a grace period has elapsed
+// Non-volatile storage for energy counters
+Preferences nvs;
+
+// Telemetry payloads waiting to be published, each in its own arena
+StaticJsonArena<JSON_ARENA_PDU_SIZE> g_pduArena;
+StaticJsonArena<JSON_ARENA_SLOT_SIZE> g_energyArena;
+StaticJsonArena<JSON_ARENA_SLOT_SIZE> g_fanArena;
+StaticJsonArena<JSON_ARENA_SLOT_SIZE> g_diagArena;
+
+JsonArena * g_telemetryArena[TELEMETRY_SLOT_COUNT] = { &g_pduArena, &g_energyArena, &g_fanArena, &g_diagArena };
+JsonDocument g_pendingTelemetry[TELEMETRY_SLOT_COUNT] = 
+{ 
+  JsonDocument(&g_pduArena), 
+  JsonDocument(&g_energyArena), 
+  JsonDocument(&g_fanArena), 
+  JsonDocument(&g_diagArena) 
+};
+
+// Documents built and published in one go
+StaticJsonArena<JSON_ARENA_SCRATCH_SIZE> g_scratchArena;
+JsonDocument g_scratchJson(&g_scratchArena);
 
 
 /*--------------------------- Program ---------------------------------*/
+void lockI2C()
+{
+  // The sensor task and loop() both talk to devices on the I2C bus
+  xSemaphoreTakeRecursive(g_i2cMutex, portMAX_DELAY);
+}
+
+void unlockI2C()
+{
+  xSemaphoreGiveRecursive(g_i2cMutex);
+}
+
+uint32_t recordStage(uint8_t stage, uint32_t startCycles)
+{
+  // CPU cycle counter is per core, each stage is only ever timed on one
+  uint32_t endCycles = ESP.getCycleCount();
+  uint32_t elapsed_us = (endCycles - startCycles) / ESP.getCpuFreqMHz();
+
+  stageStats_t * stats = &g_stageStats[stage];
+  stats->count++;
+  stats->total_us += elapsed_us;
+  stats->max_us = max(stats->max_us, elapsed_us);
+
+  uint8_t bucket = 0;
+  while (bucket < STAGE_BUCKET_COUNT - 1 && elapsed_us >= STAGE_BUCKET_US[bucket]) { bucket++; }
+  stats->buckets[bucket]++;
+
+  // So consecutive stages can be timed back to back
+  return endCycles;
+}
+
+bool isOutputOn(uint8_t output)
+{
+  // NOTE: the PDU relays are NC by default - so LOW is on, HIGH is off
+  return bitRead(g_outputShadow, output) == RELAY_ON_LEVEL;
+}
+
+void setOutput(uint8_t output, uint8_t state)
+{
+  // NOTE: the PDU relays are NC by default - so LOW to turn on, HIGH to turn off
+  lockI2C();
+  bitWrite(g_outputShadow, output, state == RELAY_ON ? RELAY_ON_LEVEL : !RELAY_ON_LEVEL);
+  g_outputShadowDirty = true;
+  unlockI2C();
+}
+
+void writeOutputs()
+{
+  // Write any changes to the relays in a single transaction
+  lockI2C();
+  if (g_outputShadowDirty && bitRead(g_mcpsFound, MCP_OUTPUT_INDEX))
+  {
+    mcp23017[MCP_OUTPUT_INDEX].writeGPIOAB(g_outputShadow);
+    g_mcpI2cStats[MCP_OUTPUT_INDEX].transactions++;
+    g_outputShadowDirty = false;
+  }
+  unlockI2C();
+}
+
 void getOutputType(char outputType[], uint8_t type)
 {
   // Determine what type of event
@@ -171,595 +632,1967 @@ void getAlertEventType(char eventType[], uint8_t alertType)
   }
 }
 
-int checkVoltageLimits(float mV)
+void resetOutputStats(uint8_t ina)
+{
+  outputStats_t * stats = &g_outputStats[ina];
+
+  stats->samples = 0;
+  stats->mAMin = INT32_MAX;
+  stats->mAMax = INT32_MIN;
+  stats->mASum = 0;
+  stats->mASumSquares = 0;
+  stats->mVMin = UINT32_MAX;
+  stats->mVMax = 0;
+  stats->mVSum = 0;
+  stats->mWMax = 0;
+  stats->mWSum = 0;
+}
+
+void updateOutputStats(uint8_t ina, int32_t mA, uint32_t mV, uint32_t mW)
 {
-  uint32_t underLimit_mV = g_supplyVoltage_mV - g_supplyVoltageDelta_mV;
-  uint32_t overLimit_mV = g_supplyVoltage_mV + g_supplyVoltageDelta_mV;
+  outputStats_t * stats = &g_outputStats[ina];
+
+  stats->samples++;
+  stats->mAMin = min(stats->mAMin, mA);
+  stats->mAMax = max(stats->mAMax, mA);
+  stats->mASum += mA;
+  stats->mASumSquares += (int64_t)mA * mA;
+  stats->mVMin = min(stats->mVMin, mV);
+  stats->mVMax = max(stats->mVMax, mV);
+  stats->mVSum += mV;
+  stats->mWMax = max(stats->mWMax, mW);
+  stats->mWSum += mW;
+}
 
-  if (mV < underLimit_mV) { return -1; }
-  if (mV > overLimit_mV)  { return 1; }
+void updateOutputEnergy(uint8_t ina, uint32_t timestamp, uint32_t mW)
+{
+  // Trapezoidal integration, so any samples skipped (e.g. dropped frames)
+  // are interpolated rather than lost
+  if (g_outputEnergyLastSample[ina] != 0L)
+  {
+    uint32_t elapsed = timestamp - g_outputEnergyLastSample[ina];
+    g_outputEnergy[ina] += ((uint64_t)g_outputEnergyLast_mW[ina] + mW) * elapsed / 2;
+    g_energyDirty = true;
+  }
 
-  return 0;
+  g_outputEnergyLastSample[ina] = timestamp;
+  g_outputEnergyLast_mW[ina] = mW;
 }
 
-void publishTelemetry(float mA[], float mV[], float mW[])
+void restoreEnergy()
 {
-  // Ignore if publishing has been disabled
-  if (g_publishTelemetry_ms == 0) { return; }
+  memset(g_outputEnergy, 0, sizeof(g_outputEnergy));
 
-  // Check if we are ready to publish
-  if ((millis() - g_lastPublishTelemetry) > g_publishTelemetry_ms)
+  if (nvs.getBytesLength("energy") == sizeof(g_outputEnergy))
   {
-    JsonDocument telemetry;
-    JsonArray array = telemetry.to<JsonArray>();
-   
-    for (uint8_t ina = 0; ina < INA_COUNT; ina++)
-    {
-      if (bitRead(g_inasFound, ina) == 0)
-        continue;
+    nvs.getBytes("energy", g_outputEnergy, sizeof(g_outputEnergy));
+  }
+}
 
-      JsonObject json = array.add<JsonObject>();
-      json["index"] = ina + 1;
-      json["mA"] = mA[ina];
-      json["mV"] = mV[ina];
-      json["mW"] = mW[ina];
-    }
+void checkpointEnergy(bool force)
+{
+  // Batch all outputs into a single write, and only write periodically
+  if (!g_energyDirty)
+    return;
 
-    // Publish to MQTT
-    if (telemetry.size() > 0)
-    {
-      oxrs.publishTelemetry(telemetry.as<JsonVariant>());
-    }
-    
-    // Reset our timer
-    g_lastPublishTelemetry = millis();
-  }
+  uint32_t interval = g_energyCheckpointDue ? ENERGY_CHECKPOINT_MIN_MS : ENERGY_CHECKPOINT_MS;
+  if (!force && (millis() - g_lastEnergyCheckpoint) < interval)
+    return;
+
+  nvs.putBytes("energy", g_outputEnergy, sizeof(g_outputEnergy));
+
+  g_lastEnergyCheckpoint = millis();
+  g_energyDirty = false;
+  g_energyCheckpointDue = false;
 }
 
-uint8_t getIndex(JsonVariant json)
+void checkpointEnergyOnShutdown()
 {
-  if (!json["index"].is<uint8_t>())
-  {
-    oxrs.println(F("[pdu ] missing index"));
-    return 0;
-  }
-  
-  uint8_t index = json["index"].as<uint8_t>();
-  
-  // Check the index is valid for this device
-  if (index <= 0 || index > INA_COUNT)
+  // Called from esp_restart(), so don't lose anything since the last checkpoint
+  checkpointEnergy(true);
+}
+
+void restoreRelayState()
+{
+  // Nothing journalled yet, so every output powers on in its default state
+  g_relayCommanded = RELAY_POWER_ON_STATE == RELAY_ON ? 0xFFFF : 0;
+  g_relayCommanded = nvs.getUShort("relays", g_relayCommanded);
+
+  if (nvs.getBytesLength("powerOn") == sizeof(g_scanner.powerOn))
   {
-    oxrs.println(F("[pdu ] invalid index"));
-    return 0;
+    nvs.getBytes("powerOn", g_scanner.powerOn, sizeof(g_scanner.powerOn));
   }
 
-  // Check the index corresponds to an existing INA260 (index is 1-based)
-  if (bitRead(g_inasFound, index - 1) == 0)
+  // Set the output shadow, latched onto the relays when the MCP is set up -
+  // an output to be on which the relay already has on at power-on (NC relays)
+  // is left on, rather than power cycling its load after a watchdog, brownout
+  // or OTA reboot, only those which start off (NO relays) are sequenced
+  uint16_t sequence = 0;
+  for (uint8_t output = 0; output < INA_COUNT; output++)
   {
-    oxrs.println(F("[pdu ] invalid index, no INA260 found"));
-    return 0;
+    bool on = bitRead(g_relayCommanded, output);
+    if (g_scanner.powerOn[output].state == POWER_ON_ON) { on = true; }
+    if (g_scanner.powerOn[output].state == POWER_ON_OFF) { on = false; }
+
+    if (on && RELAY_POWER_ON_STATE == RELAY_ON)
+    {
+      setOutput(output, RELAY_ON);
+    }
+    else
+    {
+      setOutput(output, RELAY_OFF);
+      bitWrite(sequence, output, on);
+    }
   }
-  
-  return index;
+
+  g_sequenceRequested.store(sequence);
 }
 
-void publishOutputEvent(uint8_t index, uint8_t type, uint8_t state)
+void journalRelayState(uint8_t output, uint8_t state)
 {
-  char outputType[16];
-  getOutputType(outputType, type);
-  char outputEvent[16];
-  getOutputEventType(outputEvent, state);
+  if (bitRead(g_relayCommanded, output) == (state == RELAY_ON))
+    return;
 
-  JsonDocument json;
-  json["index"] = index;
-  json["type"] = outputType;
-  json["event"] = outputEvent;
+  bitWrite(g_relayCommanded, output, state == RELAY_ON);
+  g_relayCommandedDirty = true;
+  g_relayCommandedChanged = millis();
 
-  if (!oxrs.publishStatus(json.as<JsonVariant>()))
+  // Energy accrues at a different rate from now on
+  g_energyCheckpointDue = true;
+}
+
+void checkpointRelayState()
+{
+  // Wait for things to settle so a burst of commands is a single write
+  if (!g_relayCommandedDirty || (millis() - g_relayCommandedChanged) < RELAY_STATE_WRITE_MS)
+    return;
+
+  nvs.putUShort("relays", g_relayCommanded);
+  g_relayCommandedDirty = false;
+}
+
+void setPowerOn(uint8_t ina, powerOn_t * powerOn)
+{
+  // Config is re-sent on every connect, so only write actual changes
+  if (memcmp(&g_scanner.powerOn[ina], powerOn, sizeof(powerOn_t)) == 0)
+    return;
+
+  g_scanner.powerOn[ina] = *powerOn;
+  nvs.putBytes("powerOn", g_scanner.powerOn, sizeof(g_scanner.powerOn));
+}
+
+void resetEnergy(uint8_t index)
+{
+  // Index is 1-based
+  g_outputEnergy[index - 1] = 0LL;
+  g_energyDirty = true;
+
+  // Persist immediately so a reset can't be undone by a reboot
+  checkpointEnergy(true);
+}
+
+JsonDocument & getTelemetrySlot(uint8_t slot)
+{
+  // Anything not yet published is superseded by the new payload
+  if (g_telemetryPending[slot])
   {
-    oxrs.print(F("[pdu ] [failover] "));
-    serializeJson(json, oxrs);
-    oxrs.println();
+    g_telemetrySuperseded++;
+    g_telemetryPending[slot] = false;
+  }
 
-    // TODO: add failover handling code here
+  if (slot == TELEMETRY_SLOT_PDU)
+  {
+    g_telemetryPerOutputNext = 0;
   }
+
+  // Release everything the old payload held before reusing the arena
+  g_pendingTelemetry[slot].clear();
+  g_telemetryArena[slot]->reset();
+  return g_pendingTelemetry[slot];
 }
 
-void publishAlertEvent(uint8_t index, uint8_t alertType)
+JsonDocument & getScratchDocument()
 {
-  char alertEvent[32];
-  getAlertEventType(alertEvent, alertType);
+  // NOTE: only one scratch document can be in use at a time
+  g_scratchJson.clear();
+  g_scratchArena.reset();
+  return g_scratchJson;
+}
 
-  JsonDocument json;
-  json["index"] = index;
-  json["type"] = "alert";
-  json["event"] = alertEvent;
+char * getOutputTelemetryTopic(char topic[], uint8_t index)
+{
+  oxrs.getMQTT()->getTelemetryTopic(topic);
 
-  if (!oxrs.publishStatus(json.as<JsonVariant>()))
+  if (g_publishTelemetryPerOutput)
   {
-    oxrs.print(F("[pdu ] [failover] "));
-    serializeJson(json, oxrs);
-    oxrs.println();
-
-    // TODO: add failover handling code here
+    sprintf_P(&topic[strlen(topic)], PSTR("/%d"), index);
   }
+
+  return topic;
 }
 
-/**
-  Config handler
- */
-void outputConfigSchema(JsonVariant json)
+bool sendTelemetry(uint8_t slot)
 {
-  JsonObject outputs = json["outputs"].to<JsonObject>();
-  outputs["title"] = "Output Configuration";
-  outputs["description"] = "Add configuration for each output on your device. The 1-based index specifies which output you wish to configure. An output will shutdown if the reading from the current sensor exceeds the over current limit (defaults to 2000mA or 2A, must be a number between 1 and 5000).";
-  outputs["type"] = "array";
-  
-  JsonObject items = outputs["items"].to<JsonObject>();
-  items["type"] = "object";
+  JsonDocument & telemetry = g_pendingTelemetry[slot];
+
+  if (slot != TELEMETRY_SLOT_PDU || !g_publishTelemetryPerOutput)
+  {
+    return oxrs.publishTelemetry(telemetry.as<JsonVariant>());
+  }
 
-  JsonObject properties = items["properties"].to<JsonObject>();
+  // Publish each output on its own subtopic, picking up where we left off
+  // if a previous attempt failed part way through
+  char topic[64];
+  JsonArray array = telemetry.as<JsonArray>();
+
+  while (g_telemetryPerOutputNext < array.size())
+  {
+    JsonVariant json = array[g_telemetryPerOutputNext];
+    getOutputTelemetryTopic(topic, json["index"].as<uint8_t>());
 
-  JsonObject index = properties["index"].to<JsonObject>();
-  index["title"] = "Index";
-  index["type"] = "integer";
-  index["minimum"] = 1;
-  index["maximum"] = INA_COUNT;
+    if (!oxrs.getMQTT()->publish(json, topic, false))
+      return false;
 
-  JsonObject overCurrentLimitMilliAmps = properties["overCurrentLimitMilliAmps"].to<JsonObject>();
-  overCurrentLimitMilliAmps["title"] = "Over Current Limit (mA)";
-  overCurrentLimitMilliAmps["type"] = "integer";
-  overCurrentLimitMilliAmps["minimum"] = 1;
-  overCurrentLimitMilliAmps["maximum"] = 5000;
+    g_telemetryPerOutputNext++;
+  }
 
-  JsonArray required = items["required"].to<JsonArray>();
-  required.add("index");
+  g_telemetryPerOutputNext = 0;
+  return true;
 }
 
-void setConfigSchema()
+void queueTelemetry(uint8_t slot)
 {
-  // Define our config schema
-  JsonDocument json;
+  g_telemetryPending[slot] = g_pendingTelemetry[slot].size() > 0;
+}
 
-  JsonObject publishPduTelemetrySeconds = json["publishPduTelemetrySeconds"].to<JsonObject>();
-  publishPduTelemetrySeconds["title"] = "Publish PDU Telemetry (seconds)";
-  publishPduTelemetrySeconds["description"] = "How often to publish telemetry data from the onboard INA260 current sensors (defaults to 60 seconds, setting to 0 disables telemetry reports). Must be a number between 0 and 86400 (i.e. 1 day).";
-  publishPduTelemetrySeconds["type"] = "integer";
-  publishPduTelemetrySeconds["minimum"] = 0;
-  publishPduTelemetrySeconds["maximum"] = 86400;
+void publishEnergy()
+{
+  JsonDocument & telemetry = getTelemetrySlot(TELEMETRY_SLOT_ENERGY);
+  JsonArray array = telemetry.to<JsonArray>();
 
-  JsonObject overCurrentLimitMilliAmps = json["overCurrentLimitMilliAmps"].to<JsonObject>();
-  overCurrentLimitMilliAmps["title"] = "Over Current Limit (mA)";
-  overCurrentLimitMilliAmps["description"] = "If the readings from all current sensors add up to more than this limit then shutdown all outputs (defaults to 10000mA or 10A). Must be a number between 1 and 15000 (i.e. 15A).";
-  overCurrentLimitMilliAmps["type"] = "integer";
-  overCurrentLimitMilliAmps["minimum"] = 1;
-  overCurrentLimitMilliAmps["maximum"] = 15000;
+  for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
+  {
+    uint8_t ina = g_scanner.inaList[i];
 
-  outputConfigSchema(json.as<JsonVariant>());
+    JsonObject json = array.add<JsonObject>();
+    json["index"] = ina + 1;
+    json["mWh"] = g_outputEnergy[ina] / ENERGY_MWMS_PER_MWH;
+  }
 
-  // Add any fan control config
-  fan.setConfigSchema(json.as<JsonVariant>());
+  queueTelemetry(TELEMETRY_SLOT_ENERGY);
+}
 
-  // Add any Home Assistant config
-  hass.setConfigSchema(json);
+bool isOutsideDeadband(int64_t value, int64_t last, uint32_t deadband)
+{
+  int64_t relative = (last < 0 ? -last : last) * g_telemetryDeadbandPercent / 100;
+  int64_t delta = value - last;
 
-  // Pass our config schema down to the Rack32 library
-  oxrs.setConfigSchema(json.as<JsonVariant>());
+  return (delta < 0 ? -delta : delta) > max((int64_t)deadband, relative);
 }
 
-void jsonOutputConfig(JsonVariant json)
+void checkTelemetryChanged(inaFrame_t * frame, uint8_t ina)
 {
-  uint8_t index = getIndex(json);
-  if (index == 0) return;
+  if (bitRead(g_telemetryChanged, ina))
+    return;
 
-  // Index is 1-based
-  uint8_t ina = index - 1;
-  
-  if (json["overCurrentLimitMilliAmps"].is<uint32_t>())
+  if (isOutsideDeadband(frame->mA[ina], g_publishedmA[ina], g_telemetryDeadband_mA) ||
+      isOutsideDeadband(frame->mV[ina], g_publishedmV[ina], g_telemetryDeadband_mV) ||
+      isOutsideDeadband(frame->mW[ina], g_publishedmW[ina], g_telemetryDeadband_mW))
   {
-    uint32_t overCurrentLimit_mA = json["overCurrentLimitMilliAmps"].as<uint32_t>();
+    bitWrite(g_telemetryChanged, ina, 1);
+  }
+}
 
-    // Set the alert limit on the INA260 and re-scale the bar graph on the display
-    ina260[ina].setAlertLimit(overCurrentLimit_mA);
+void addOutputTelemetry(JsonObject json, inaFrame_t * frame, uint8_t ina)
+{
+  json["index"] = ina + 1;
+  json["mA"] = frame->mA[ina];
+  json["mV"] = frame->mV[ina];
+  json["mW"] = frame->mW[ina];
+  json["mWh"] = g_outputEnergy[ina] / ENERGY_MWMS_PER_MWH;
+
+  // Add the statistics for every sample since the last publish
+  outputStats_t * stats = &g_outputStats[ina];
+  if (stats->samples > 0)
+  {
+    json["mAMin"] = stats->mAMin;
+    json["mAMax"] = stats->mAMax;
+    json["mAAvg"] = (int32_t)(stats->mASum / (int64_t)stats->samples);
+    json["mARms"] = (uint32_t)sqrt((double)stats->mASumSquares / stats->samples);
+    json["mVMin"] = stats->mVMin;
+    json["mVMax"] = stats->mVMax;
+    json["mVAvg"] = (uint32_t)(stats->mVSum / stats->samples);
+    json["mWMax"] = stats->mWMax;
+    json["mWAvg"] = (uint32_t)(stats->mWSum / stats->samples);
+    json["samples"] = stats->samples;
   }
 }
 
-void jsonConfig(JsonVariant json)
+void addCompactTelemetry(JsonObject json, inaFrame_t * frame, uint8_t ina)
 {
-  if (json["publishPduTelemetrySeconds"].is<uint32_t>())
+  outputStats_t * stats = &g_outputStats[ina];
+  uint32_t samples = stats->samples;
+
+  // Each column is created as an array when the first entry is added, and
+  // the keys are string literals so are stored by reference, not copied
+  json["index"].add(ina + 1);
+  json["mA"].add(frame->mA[ina]);
+  json["mV"].add(frame->mV[ina]);
+  json["mW"].add(frame->mW[ina]);
+  json["mWh"].add(g_outputEnergy[ina] / ENERGY_MWMS_PER_MWH);
+  json["samples"].add(samples);
+
+  json["mAMin"].add(samples ? stats->mAMin : 0);
+  json["mAMax"].add(samples ? stats->mAMax : 0);
+  json["mAAvg"].add(samples ? (int32_t)(stats->mASum / (int64_t)samples) : 0);
+  json["mARms"].add(samples ? (uint32_t)sqrt((double)stats->mASumSquares / samples) : 0);
+  json["mVMin"].add(samples ? stats->mVMin : 0);
+  json["mVMax"].add(samples ? stats->mVMax : 0);
+  json["mVAvg"].add(samples ? (uint32_t)(stats->mVSum / samples) : 0);
+  json["mWMax"].add(samples ? stats->mWMax : 0);
+  json["mWAvg"].add(samples ? (uint32_t)(stats->mWSum / samples) : 0);
+}
+
+void queueOutputTelemetry(inaFrame_t * frame, uint16_t outputs, bool newWindow)
+{
+  // Don't lose any outputs still waiting in a payload we are superseding
+  if (g_telemetryPending[TELEMETRY_SLOT_PDU])
   {
-    g_publishTelemetry_ms = json["publishPduTelemetrySeconds"].as<uint32_t>() * 1000L;
+    outputs |= g_telemetryOutputs;
   }
 
-  if (json["overCurrentLimitMilliAmps"].is<uint32_t>())
+  JsonDocument & telemetry = getTelemetrySlot(TELEMETRY_SLOT_PDU);
+
+  if (g_publishTelemetryCompact && !g_publishTelemetryPerOutput)
+  {
+    telemetry.to<JsonObject>();
+  }
+  else
   {
-    g_overCurrentLimit_mA = json["overCurrentLimitMilliAmps"].as<uint32_t>();
+    telemetry.to<JsonArray>();
   }
 
-  if (json["outputs"].is<JsonArray>())
+  for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
   {
-    for (JsonVariant output : json["outputs"].as<JsonArray>())
+    uint8_t ina = g_scanner.inaList[i];
+    if (bitRead(outputs, ina) == 0)
+      continue;
+
+    if (telemetry.is<JsonObject>())
     {
-      jsonOutputConfig(output);
+      addCompactTelemetry(telemetry.as<JsonObject>(), frame, ina);
+    }
+    else
+    {
+      addOutputTelemetry(telemetry.add<JsonObject>(), frame, ina);
     }
+
+    // Start a new window on the periodic publish only, on-change payloads
+    // report the window so far
+    if (newWindow)
+    {
+      resetOutputStats(ina);
+    }
+
+    // Remember what we published for the deadband checks
+    g_publishedmA[ina] = frame->mA[ina];
+    g_publishedmV[ina] = frame->mV[ina];
+    g_publishedmW[ina] = frame->mW[ina];
   }
 
-  // Pass on to the fan control library
-  fan.onConfig(json);
+  // Queue for publishing to MQTT
+  g_telemetryOutputs = outputs;
+  queueTelemetry(TELEMETRY_SLOT_PDU);
 
-  // Handle any Home Assistant config
-  hass.parseConfig(json);
+  // Any changes are now covered
+  g_telemetryChanged &= ~outputs;
+  g_lastPublishTelemetryChange = millis();
 }
 
-/**
-  Command handler
- */
-void outputCommandSchema(JsonVariant json)
+void publishTelemetry(inaFrame_t * frame)
 {
-  JsonObject outputs = json["outputs"].to<JsonObject>();
-  outputs["title"] = "Output Commands";
-  outputs["description"] = "Send commands to one or more outputs on your device. The 1-based index specifies which output you wish to command. Supported commands are ‘on’ or ‘off’ to change the output state, or ‘query’ to publish the current state to MQTT.";
-  outputs["type"] = "array";
-  
-  JsonObject items = outputs["items"].to<JsonObject>();
-  items["type"] = "object";
-
-  JsonObject properties = items["properties"].to<JsonObject>();
-
-  JsonObject index = properties["index"].to<JsonObject>();
-  index["title"] = "Index";
-  index["type"] = "integer";
-  index["minimum"] = 1;
-  index["maximum"] = INA_COUNT;
+  // Ignore if publishing has been disabled
+  if (g_publishTelemetry_ms == 0) { return; }
 
-  JsonObject command = properties["command"].to<JsonObject>();
-  command["title"] = "Command";
-  command["type"] = "string";
-  JsonArray commandEnum = command["enum"].to<JsonArray>();
-  commandEnum.add("query");
-  commandEnum.add("on");
-  commandEnum.add("off");
+  // Check if we are ready to publish (or due a heartbeat if reporting changes)
+  if ((millis() - g_lastPublishTelemetry) > g_publishTelemetry_ms)
+  {
+    queueOutputTelemetry(frame, g_scanner.inasFound, true);
+    
+    // Reset our timer
+    g_lastPublishTelemetry = millis();
+    return;
+  }
 
-  JsonArray required = items["required"].to<JsonArray>();
-  required.add("index");
-  required.add("command");
+  // Publish any outputs which have changed if reporting changes
+  if (g_publishTelemetryOnChange && g_telemetryChanged != 0)
+  {
+    if ((millis() - g_lastPublishTelemetryChange) >= g_telemetryMinInterval_ms)
+    {
+      queueOutputTelemetry(frame, g_telemetryChanged, false);
+    }
+  }
 }
 
-void setCommandSchema()
+uint8_t getIndex(JsonVariant json)
 {
-  // Define our config schema
-  JsonDocument json;
-
-  JsonObject queryOutputs = json["queryOutputs"].to<JsonObject>();
-  queryOutputs["title"] = "Query Outputs";
-  queryOutputs["description"] = "Query and publish the state of all outputs.";
-  queryOutputs["type"] = "boolean";
+  if (!json["index"].is<uint8_t>())
+  {
+    oxrs.println(F("[pdu ] missing index"));
+    return 0;
+  }
+  
+  uint8_t index = json["index"].as<uint8_t>();
+  
+  // Check the index is valid for this device
+  if (index <= 0 || index > INA_COUNT)
+  {
+    oxrs.println(F("[pdu ] invalid index"));
+    return 0;
+  }
 
-  // Add the output commands
-  outputCommandSchema(json.as<JsonVariant>());
+  // Check the index corresponds to an existing INA260 (index is 1-based)
+  if (bitRead(g_scanner.inasFound, index - 1) == 0)
+  {
+    oxrs.println(F("[pdu ] invalid index, no INA260 found"));
+    return 0;
+  }
   
-  // Add any fan control commands
-  fan.setCommandSchema(json.as<JsonVariant>());
+  return index;
+}
 
-  // Pass our command schema down to the Rack32 library
-  oxrs.setCommandSchema(json.as<JsonVariant>());
+void publishOutputEvent(uint8_t index, uint8_t type, uint8_t state)
+{
+  g_publishQueue.push(index, type, state);
 }
 
-void queryOutputState(uint8_t index)
+void publishAlertEvent(uint8_t index, uint8_t alertType)
 {
-  // Output index is 1-based
-  uint8_t state = mcp23017[MCP_OUTPUT_INDEX].digitalRead(index - 1);
+  g_publishQueue.push(index, ALERT_EVENT, alertType);
+}
+
+bool sendStatusEvent(statusEvent_t * statusEvent)
+{
+  char type[16];
+  char event[32];
+
+  if (statusEvent->type == ALERT_EVENT)
+  {
+    sprintf_P(type, PSTR("alert"));
+    getAlertEventType(event, statusEvent->event);
+  }
+  else
+  {
+    getOutputType(type, statusEvent->type);
+    getOutputEventType(event, statusEvent->event);
+  }
+
+  JsonDocument & json = getScratchDocument();
+  json["index"] = statusEvent->index;
+  json["type"] = type;
+  json["event"] = event;
+
+  if (!oxrs.publishStatus(json.as<JsonVariant>()))
+  {
+    if (!g_publishBackoff.isFailed())
+    {
+      oxrs.print(F("[pdu ] [failover] queueing "));
+      serializeJson(json, oxrs);
+      oxrs.println();
+    }
+
+    return false;
+  }
+
+  return true;
+}
+
+void getDiagnostics(JsonObject diagnostics)
+{
+  JsonObject publishQueue = diagnostics["publishQueue"].to<JsonObject>();
+  publishQueue["depth"] = g_publishQueue.count();
+  publishQueue["maxDepth"] = g_publishQueue.maxCount();
+  publishQueue["dropped"] = g_publishQueue.dropped();
+  publishQueue["coalesced"] = g_publishQueue.coalesced();
+  publishQueue["failures"] = g_publishBackoff.failures();
+  publishQueue["telemetrySuperseded"] = g_telemetrySuperseded;
+
+  JsonObject inputs = diagnostics["inputs"].to<JsonObject>();
+  inputs["reads"] = g_inputReads;
+
+  JsonObject sensors = diagnostics["sensors"].to<JsonObject>();
+  sensors["framesDropped"] = g_inaFramesDropped;
+  sensors["tripLatencyMaxMicros"] = g_tripLatencyMax_us;
+  sensors["recordingsMissed"] = g_recorderMissed;
+  sensors["scanPeriodMillis"] = g_inaCycleTime_ms;
+  sensors["scansMissed"] = g_inaScansMissed;
+
+  // Latency histograms, counts per bucket with the bucket upper bounds alongside
+  JsonObject stages = diagnostics["stages"].to<JsonObject>();
+  JsonArray bucketMicros = stages["bucketMicros"].to<JsonArray>();
+  for (uint32_t bucket_us : STAGE_BUCKET_US)
+  {
+    bucketMicros.add(bucket_us);
+  }
+
+  for (uint8_t stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    stageStats_t * stats = &g_stageStats[stage];
+
+    JsonObject json = stages[STAGE_NAMES[stage]].to<JsonObject>();
+    json["count"] = stats->count;
+    json["avgMicros"] = stats->count ? (uint32_t)(stats->total_us / stats->count) : 0;
+    json["maxMicros"] = stats->max_us;
+
+    JsonArray buckets = json["buckets"].to<JsonArray>();
+    for (uint8_t bucket = 0; bucket < STAGE_BUCKET_COUNT; bucket++)
+    {
+      buckets.add(stats->buckets[bucket]);
+    }
+  }
+
+  // Bus counters for every device found (index is 1-based)
+  JsonObject i2c = diagnostics["i2c"].to<JsonObject>();
+  JsonArray inas = i2c["ina"].to<JsonArray>();
+  for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
+  {
+    uint8_t ina = g_scanner.inaList[i];
+
+    JsonObject json = inas.add<JsonObject>();
+    json["index"] = ina + 1;
+    json["transactions"] = g_inaI2cStats[ina].transactions;
+    json["errors"] = g_inaI2cStats[ina].errors;
+    json["nacks"] = g_inaI2cStats[ina].nacks;
+  }
+
+  JsonArray mcps = i2c["mcp"].to<JsonArray>();
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    if (bitRead(g_mcpsFound, mcp) == 0)
+      continue;
+
+    JsonObject json = mcps.add<JsonObject>();
+    json["index"] = mcp;
+    json["transactions"] = g_mcpI2cStats[mcp].transactions;
+  }
+
+  JsonObject boot = diagnostics["boot"].to<JsonObject>();
+  boot["relaysMillis"] = g_bootRelays_ms;
+  boot["sensorsMillis"] = g_bootSensors_ms;
+  boot["firstSampleMillis"] = g_bootFirstSample_ms;
+  boot["networkMillis"] = g_bootNetwork_ms;
+  boot["firstPublishMillis"] = g_bootFirstPublish_ms;
+
+  JsonObject heap = diagnostics["heap"].to<JsonObject>();
+  heap["free"] = ESP.getFreeHeap();
+  heap["minFree"] = ESP.getMinFreeHeap();
+  heap["sensorTaskStackFree"] = uxTaskGetStackHighWaterMark(g_sensorTask);
+  heap["loopTaskStackFree"] = uxTaskGetStackHighWaterMark(NULL);
+
+  // How broken up the free heap is (0% when it is one contiguous block)
+  uint32_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t largestFreeBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  heap["largestFreeBlock"] = largestFreeBlock;
+  heap["fragmentationPercent"] = freeHeap ? 100 - (largestFreeBlock * 100 / freeHeap) : 0;
+
+  // Peak usage of each JSON arena (bytes), and any allocations refused
+  JsonObject jsonArenas = heap["jsonArenas"].to<JsonObject>();
+  jsonArenas["pdu"] = g_pduArena.peak();
+  jsonArenas["energy"] = g_energyArena.peak();
+  jsonArenas["fan"] = g_fanArena.peak();
+  jsonArenas["diagnostics"] = g_diagArena.peak();
+  jsonArenas["scratch"] = g_scratchArena.peak();
+
+  uint32_t overflows = g_scratchArena.overflows();
+  for (uint8_t slot = 0; slot < TELEMETRY_SLOT_COUNT; slot++)
+  {
+    overflows += g_telemetryArena[slot]->overflows();
+  }
+  jsonArenas["overflows"] = overflows;
+}
+
+void apiGetDiagnostics(Request &req, Response &res)
+{
+  JsonDocument & json = getScratchDocument();
+  getDiagnostics(json.to<JsonObject>());
+
+  res.set("Content-Type", "application/json");
+  serializeJson(json, res);
+}
+
+void publishDiagnostics()
+{
+  JsonDocument & telemetry = getTelemetrySlot(TELEMETRY_SLOT_DIAG);
+  getDiagnostics(telemetry["diagnostics"].to<JsonObject>());
+
+  queueTelemetry(TELEMETRY_SLOT_DIAG);
+}
+
+void requestCapture(uint8_t index, bool inrush)
+{
+  if (bitRead(g_scanner.inasFound, index - 1) == 0)
+  {
+    oxrs.println(F("[pdu ] no current sensor to capture"));
+    return;
+  }
+
+  if (g_captureState.load(std::memory_order_acquire) != CAPTURE_IDLE)
+  {
+    oxrs.println(F("[pdu ] capture already in progress"));
+    return;
+  }
+
+  g_captureIna = index - 1;
+  g_captureInrush = inrush;
+  g_captureChunk = 0;
+  g_captureState.store(CAPTURE_REQUESTED, std::memory_order_release);
+}
+
+bool sendCaptureChunk()
+{
+  uint8_t state = g_captureState.load(std::memory_order_acquire);
+
+  // Switch on once the sensor is reading fast, so the capture sees the inrush
+  if (state == CAPTURE_RUNNING && g_captureInrush)
+  {
+    oxrsOutput.handleCommand(MCP_OUTPUT_INDEX, g_captureIna, RELAY_ON);
+    writeOutputs();
+    g_captureInrush = false;
+  }
+
+  if (state != CAPTURE_COMPLETE)
+    return true;
+
+  if (g_captureCount == 0)
+  {
+    oxrs.println(F("[pdu ] capture failed, no samples read"));
+    g_captureState.store(CAPTURE_IDLE, std::memory_order_release);
+    return true;
+  }
+
+  JsonDocument & json = getScratchDocument();
+  static char topic[64];
+
+  uint16_t chunks = (g_captureCount + CAPTURE_CHUNK_SIZE - 1) / CAPTURE_CHUNK_SIZE;
+  uint16_t first = g_captureChunk * CAPTURE_CHUNK_SIZE;
+  uint16_t last = min((uint16_t)(first + CAPTURE_CHUNK_SIZE), g_captureCount);
+
+  json["index"] = g_captureIna + 1;
+  json["chunk"] = g_captureChunk + 1;
+  json["chunks"] = chunks;
+
+  JsonArray us = json["us"].to<JsonArray>();
+  JsonArray mA = json["mA"].to<JsonArray>();
+  JsonArray mV = json["mV"].to<JsonArray>();
+
+  for (uint16_t i = first; i < last; i++)
+  {
+    captureSample_t * sample = &g_captureSamples[i];
+    us.add(sample->time_us);
+    mA.add(((int32_t)sample->current * INA260_CURRENT_LSB_UA) / 1000L);
+    mV.add(((uint32_t)sample->voltage * INA260_VOLTAGE_LSB_UV) / 1000L);
+  }
+
+  oxrs.getMQTT()->getTelemetryTopic(topic);
+  sprintf_P(&topic[strlen(topic)], PSTR("/capture"));
+
+  if (!oxrs.getMQTT()->publish(json.as<JsonVariant>(), topic, false))
+    return false;
+
+  // Release the buffer for another capture once the last chunk is out
+  if (++g_captureChunk >= chunks)
+  {
+    oxrs.print(F("[pdu ] capture published, "));
+    oxrs.print(g_captureCount);
+    oxrs.println(F(" samples"));
+
+    g_captureState.store(CAPTURE_IDLE, std::memory_order_release);
+  }
+
+  return true;
+}
+
+bool sendRecorderSnapshot()
+{
+  uint16_t outputs = g_recorderOutputs.load(std::memory_order_acquire);
+  if (outputs == 0)
+    return true;
+
+  JsonDocument & json = getScratchDocument();
+  static char topic[64];
+  char alertType[16];
+
+  uint8_t ina = 0;
+  while (bitRead(outputs, ina) == 0) { ina++; }
+
+  getAlertEventType(alertType, g_recorderAlertType[ina]);
+
+  json["index"] = ina + 1;
+  json["alert"] = alertType;
+
+  // Times are relative to the scan which triggered the recording
+  JsonArray ms = json["ms"].to<JsonArray>();
+  JsonArray mA = json["mA"].to<JsonArray>();
+  JsonArray mV = json["mV"].to<JsonArray>();
+
+  for (uint8_t i = RECORDER_SAMPLE_COUNT - g_recorderSamples; i < RECORDER_SAMPLE_COUNT; i++)
+  {
+    ms.add((int32_t)(g_recorderSnapshot.timestamp[i] - g_recorderTriggerTime));
+    mA.add(g_recorderSnapshot.mA[i][ina]);
+    mV.add(g_recorderSnapshot.mV[i][ina]);
+  }
+
+  oxrs.getMQTT()->getTelemetryTopic(topic);
+  sprintf_P(&topic[strlen(topic)], PSTR("/recorder"));
+
+  if (!oxrs.getMQTT()->publish(json.as<JsonVariant>(), topic, false))
+    return false;
+
+  // The sensor task can freeze another snapshot once every output is out
+  g_recorderOutputs.store(outputs & ~(1 << ina), std::memory_order_release);
+  return true;
+}
+
+void publishSucceeded()
+{
+  if (g_bootFirstPublish_ms != 0L)
+    return;
+
+  g_bootFirstPublish_ms = millis();
+
+  oxrs.print(F("[pdu ] boot: relays "));
+  oxrs.print(g_bootRelays_ms);
+  oxrs.print(F("ms, sensors "));
+  oxrs.print(g_bootSensors_ms);
+  oxrs.print(F("ms, first protected sample "));
+  oxrs.print(g_bootFirstSample_ms);
+  oxrs.print(F("ms, network "));
+  oxrs.print(g_bootNetwork_ms);
+  oxrs.print(F("ms, first publish "));
+  oxrs.print(g_bootFirstPublish_ms);
+  oxrs.println(F("ms"));
+}
+
+bool publishStatusEvent(statusEvent_t * statusEvent)
+{
+  if (!sendStatusEvent(statusEvent))
+    return false;
+
+  publishSucceeded();
+  return true;
+}
+
+void publishFailed()
+{
+  // Back off and try again shortly, leaving everything queued
+  g_publishBackoff.fail(millis());
+}
+
+void processPublishQueue()
+{
+  // Publish the diagnostics (with the boot timings) once protection is up
+  if (g_queryDiagnostics || (!g_bootReportQueued && g_bootFirstSample_ms != 0L))
+  {
+    publishDiagnostics();
+    g_queryDiagnostics = false;
+    g_bootReportQueued = true;
+  }
+
+  if (g_publishBackoff.isWaiting(millis()))
+    return;
+
+  // Status events first, in order, never more than a few per loop
+  if (!g_publishQueue.drain(PUBLISH_QUEUE_BURST, publishStatusEvent))
+  {
+    publishFailed();
+    return;
+  }
+
+  // Republish every output once drained if any relay event was dropped
+  if (g_publishQueue.count() == 0 && g_publishQueue.takeResync())
+  {
+    g_queryOutputs = true;
+  }
+
+  // Then any pending telemetry
+  for (uint8_t slot = 0; slot < TELEMETRY_SLOT_COUNT; slot++)
+  {
+    if (!g_telemetryPending[slot])
+      continue;
+
+    if (!sendTelemetry(slot))
+    {
+      publishFailed();
+      return;
+    }
+
+    g_telemetryPending[slot] = false;
+    publishSucceeded();
+  }
+
+  // Then the next chunk of any completed waveform capture
+  if (!sendCaptureChunk())
+  {
+    publishFailed();
+    return;
+  }
+
+  // Then the next output from any flight recorder snapshot
+  if (!sendRecorderSnapshot())
+  {
+    publishFailed();
+    return;
+  }
+
+  if (g_publishBackoff.takeRecovered(g_publishQueue.count() == 0))
+  {
+    oxrs.println(F("[pdu ] [failover] queued events replayed"));
+  }
+}
+
+/**
+  Config handler
+ */
+void setConfigSchema()
+{
+  // Define our config schema (all titles, descriptions etc are string literals
+  // so stay in flash, only referenced from the document)
+  JsonDocument & json = getScratchDocument();
+
+  // Add the PDU config (outputs etc)
+  pduConfigSchema(json.as<JsonVariant>(), INA_COUNT);
+
+  // Add any fan control config
+  fan.setConfigSchema(json.as<JsonVariant>());
+
+  // Add any Home Assistant config
+  hass.setConfigSchema(json);
+
+  if (json.overflowed())
+  {
+    oxrs.println(F("[pdu ] config schema truncated, JSON_ARENA_SCRATCH_SIZE too small"));
+  }
+
+  // Pass our config schema down to the Rack32 library
+  oxrs.setConfigSchema(json.as<JsonVariant>());
+}
+
+void jsonOutputConfig(JsonVariant json)
+{
+  uint8_t index = getIndex(json);
+  if (index == 0) return;
+
+  // Index is 1-based
+  uint8_t ina = index - 1;
+  protection_t * protection = &g_scanner.protection[ina];
+  
+  if (json["overCurrentLimitMilliAmps"].is<uint16_t>())
+  {
+    protection->limit_mA = json["overCurrentLimitMilliAmps"].as<uint16_t>();
+  }
+
+  if (json["instantTripMilliAmps"].is<uint16_t>())
+  {
+    protection->instantLimit_mA = json["instantTripMilliAmps"].as<uint16_t>();
+  }
+
+  if (json["tripDelayMilliSeconds"].is<uint16_t>())
+  {
+    protection->tripDelay_ms = json["tripDelayMilliSeconds"].as<uint16_t>();
+  }
+
+  if (json["inrushMilliAmps"].is<uint16_t>())
+  {
+    protection->inrush_mA = json["inrushMilliAmps"].as<uint16_t>();
+  }
+
+  if (json["inrushMilliSeconds"].is<uint16_t>())
+  {
+    protection->inrushTime_ms = json["inrushMilliSeconds"].as<uint16_t>();
+  }
+
+  if (json["retryCount"].is<uint8_t>())
+  {
+    protection->retryCount = json["retryCount"].as<uint8_t>();
+  }
+
+  if (json["retryDelaySeconds"].is<uint16_t>())
+  {
+    protection->retryDelay_s = json["retryDelaySeconds"].as<uint16_t>();
+  }
+
+  if (json["priority"].is<uint8_t>())
+  {
+    protection->priority = json["priority"].as<uint8_t>();
+  }
+
+  powerOn_t powerOn = g_scanner.powerOn[ina];
+
+  if (json["powerOnState"].is<const char *>())
+  {
+    if (strcmp(json["powerOnState"], "last") == 0)
+    {
+      powerOn.state = POWER_ON_LAST;
+    }
+    else if (strcmp(json["powerOnState"], "on") == 0)
+    {
+      powerOn.state = POWER_ON_ON;
+    }
+    else if (strcmp(json["powerOnState"], "off") == 0)
+    {
+      powerOn.state = POWER_ON_OFF;
+    }
+    else
+    {
+      oxrs.println(F("[pdu ] invalid powerOnState"));
+    }
+  }
+
+  if (json["powerOnOrder"].is<uint8_t>())
+  {
+    powerOn.order = json["powerOnOrder"].as<uint8_t>();
+  }
+
+  if (json["powerOnDelayMilliSeconds"].is<uint16_t>())
+  {
+    powerOn.delay_ms = json["powerOnDelayMilliSeconds"].as<uint16_t>();
+  }
+
+  setPowerOn(ina, &powerOn);
+
+  // Set the alert limit on the INA260
+  lockI2C();
+  ina260[ina].setAlertLimit(getAlertLimit(protection));
+  unlockI2C();
+}
+
+void jsonConfig(JsonVariant json)
+{
+  if (json["publishPduTelemetrySeconds"].is<uint32_t>())
+  {
+    g_publishTelemetry_ms = json["publishPduTelemetrySeconds"].as<uint32_t>() * 1000L;
+  }
+
+  if (json["publishPduTelemetryPerOutput"].is<bool>())
+  {
+    bool perOutput = json["publishPduTelemetryPerOutput"].as<bool>();
+
+    // Home Assistant sensors need to be re-pointed at the new topics
+    if (perOutput != g_publishTelemetryPerOutput)
+    {
+      for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+      {
+        g_hassDiscoveryPublished[ina] &= ~HASS_TELEMETRY_ENTITIES;
+      }
+    }
+
+    g_publishTelemetryPerOutput = perOutput;
+    g_telemetryPerOutputNext = 0;
+  }
+
+  if (json["publishPduTelemetryCompact"].is<bool>())
+  {
+    bool compact = json["publishPduTelemetryCompact"].as<bool>();
+
+    // Home Assistant sensors need new value templates
+    if (compact != g_publishTelemetryCompact)
+    {
+      for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+      {
+        g_hassDiscoveryPublished[ina] &= ~HASS_TELEMETRY_ENTITIES;
+      }
+    }
+
+    g_publishTelemetryCompact = compact;
+  }
+
+  if (json["publishPduTelemetryOnChange"].is<bool>())
+  {
+    g_publishTelemetryOnChange = json["publishPduTelemetryOnChange"].as<bool>();
+  }
+
+  if (json["telemetryDeadbandMilliAmps"].is<uint32_t>())
+  {
+    g_telemetryDeadband_mA = json["telemetryDeadbandMilliAmps"].as<uint32_t>();
+  }
+
+  if (json["telemetryDeadbandMilliVolts"].is<uint32_t>())
+  {
+    g_telemetryDeadband_mV = json["telemetryDeadbandMilliVolts"].as<uint32_t>();
+  }
+
+  if (json["telemetryDeadbandMilliWatts"].is<uint32_t>())
+  {
+    g_telemetryDeadband_mW = json["telemetryDeadbandMilliWatts"].as<uint32_t>();
+  }
+
+  if (json["telemetryDeadbandPercent"].is<uint32_t>())
+  {
+    g_telemetryDeadbandPercent = json["telemetryDeadbandPercent"].as<uint32_t>();
+  }
+
+  if (json["telemetryMinIntervalMilliSeconds"].is<uint32_t>())
+  {
+    g_telemetryMinInterval_ms = json["telemetryMinIntervalMilliSeconds"].as<uint32_t>();
+  }
+
+  if (json["overCurrentLimitMilliAmps"].is<uint32_t>())
+  {
+    g_scanner.overCurrentLimit_mA = json["overCurrentLimitMilliAmps"].as<uint32_t>();
+  }
+
+  if (json["inaAveragingCount"].is<uint16_t>())
+  {
+    uint16_t count = json["inaAveragingCount"].as<uint16_t>();
+    for (uint8_t i = 0; i < sizeof(INA_AVERAGING_COUNTS) / sizeof(INA_AVERAGING_COUNTS[0]); i++)
+    {
+      if (INA_AVERAGING_COUNTS[i] == count)
+      {
+        g_inaAveragingCount = (INA260_AveragingCount)i;
+        g_inaConversionChanged = true;
+      }
+    }
+  }
+
+  if (json["inaConversionTimeMicroSeconds"].is<uint16_t>())
+  {
+    uint16_t time = json["inaConversionTimeMicroSeconds"].as<uint16_t>();
+    for (uint8_t i = 0; i < sizeof(INA_CONVERSION_TIMES_US) / sizeof(INA_CONVERSION_TIMES_US[0]); i++)
+    {
+      if (INA_CONVERSION_TIMES_US[i] == time)
+      {
+        g_inaConversionTime = (INA260_ConversionTime)i;
+        g_inaConversionChanged = true;
+      }
+    }
+  }
+
+  if (json["inaIdleScanInterval"].is<uint8_t>())
+  {
+    g_scanner.inaIdleScanInterval = constrain(json["inaIdleScanInterval"].as<uint8_t>(), 1, 16);
+  }
+
+  if (json["loadShedHysteresisMilliAmps"].is<uint32_t>())
+  {
+    g_scanner.loadShedHysteresis_mA = json["loadShedHysteresisMilliAmps"].as<uint32_t>();
+  }
+
+  if (json["loadShedRestoreSeconds"].is<uint32_t>())
+  {
+    g_scanner.loadShedRestore_ms = json["loadShedRestoreSeconds"].as<uint32_t>() * 1000L;
+  }
+
+  if (json["powerOnSettleMilliAmps"].is<uint32_t>())
+  {
+    g_scanner.sequenceSettle_mA = json["powerOnSettleMilliAmps"].as<uint32_t>();
+  }
+
+  if (json["outputs"].is<JsonArray>())
+  {
+    for (JsonVariant output : json["outputs"].as<JsonArray>())
+    {
+      jsonOutputConfig(output);
+    }
+  }
+
+  if (json["hassDiscoveryEntitiesPerLoop"].is<uint8_t>())
+  {
+    g_hassDiscoveryPerLoop = max(json["hassDiscoveryEntitiesPerLoop"].as<uint8_t>(), (uint8_t)1);
+  }
+
+  // Pass on to the fan control library
+  lockI2C();
+  fan.onConfig(json);
+  unlockI2C();
+
+  // Handle any Home Assistant config
+  hass.parseConfig(json);
+}
+
+/**
+  Command handler
+ */
+void setCommandSchema()
+{
+  // Define our command schema (string literals, as above)
+  JsonDocument & json = getScratchDocument();
+
+  // Add the PDU commands (outputs etc)
+  pduCommandSchema(json.as<JsonVariant>(), INA_COUNT);
+
+  // Add any fan control commands
+  fan.setCommandSchema(json.as<JsonVariant>());
+
+  if (json.overflowed())
+  {
+    oxrs.println(F("[pdu ] command schema truncated, JSON_ARENA_SCRATCH_SIZE too small"));
+  }
+
+  // Pass our command schema down to the Rack32 library
+  oxrs.setCommandSchema(json.as<JsonVariant>());
+}
+
+void queryOutputState(uint8_t index)
+{
+  // Output index is 1-based
+  publishOutputEvent(index, RELAY, isOutputOn(index - 1) ? RELAY_ON : RELAY_OFF);
+}
+
+void requestSequence(uint8_t output)
+{
+  // Nothing to sequence if already on, just let the output handler publish it
+  if (isOutputOn(output))
+  {
+    oxrsOutput.handleCommand(MCP_OUTPUT_INDEX, output, RELAY_ON);
+    return;
+  }
+
+  // Remember what we were told, the sensor task publishes the event once closed
+  journalRelayState(output, RELAY_ON);
+
+  g_sequenceCancelled.fetch_and(~(1 << output));
+  g_sequenceRequested.fetch_or(1 << output);
+}
+
+void jsonOutputCommand(JsonVariant json, bool sequence)
+{
+  // Index is 1-based
+  uint8_t index = getIndex(json);
+  if (index == 0) return;
+
+  if (json["command"].is<const char *>())
+  {
+    if (json["command"].isNull() || strcmp(json["command"], "query") == 0)
+    {
+      // Publish a status event with the current state
+      queryOutputState(index);
+    }
+    else if (strcmp(json["command"], "resetEnergy") == 0)
+    {
+      // Zero the energy counter for this output
+      resetEnergy(index);
+    }
+    else if (strcmp(json["command"], "capture") == 0)
+    {
+      // Record a high-rate waveform for this output
+      requestCapture(index, false);
+    }
+    else if (strcmp(json["command"], "captureInrush") == 0)
+    {
+      // ...and switch it on once recording
+      requestCapture(index, true);
+    }
+    else
+    {
+      // Send this command down to our output handler to process
+      if (strcmp(json["command"], "on") == 0 && sequence)
+      {
+        requestSequence(index - 1);
+      }
+      else if (strcmp(json["command"], "on") == 0)
+      {
+        oxrsOutput.handleCommand(MCP_OUTPUT_INDEX, index - 1, RELAY_ON);
+      }
+      else if (strcmp(json["command"], "off") == 0)
+      {
+        oxrsOutput.handleCommand(MCP_OUTPUT_INDEX, index - 1, RELAY_OFF);
+      }
+      else 
+      {
+        oxrs.println(F("[pdu ] invalid command"));
+      }
+    }
+  }
+}
+
+void jsonCommand(JsonVariant json)
+{
+  if (json.containsKey("queryOutputs"))
+  {
+    g_queryOutputs = json["queryOutputs"].as<bool>();
+  }
+
+  if (json.containsKey("queryEnergy"))
+  {
+    g_queryEnergy = json["queryEnergy"].as<bool>();
+  }
+
+  if (json.containsKey("queryDiagnostics"))
+  {
+    g_queryDiagnostics = json["queryDiagnostics"].as<bool>();
+  }
+
+  if (json["outputs"].is<JsonArray>())
+  {
+    // Switching several outputs on at once goes via the power-on sequencer
+    uint8_t onCount = 0;
+    for (JsonVariant output : json["outputs"].as<JsonArray>())
+    {
+      if (output["command"].is<const char *>() && strcmp(output["command"], "on") == 0)
+      {
+        onCount++;
+      }
+    }
+
+    for (JsonVariant output : json["outputs"].as<JsonArray>())
+    {
+      jsonOutputCommand(output, onCount > 1);
+    }
+
+    // Write all the relay changes in one go
+    writeOutputs();
+  }
+
+  // Pass on to the fan control library
+  lockI2C();
+  fan.onCommand(json);
+  unlockI2C();
+}
+
+bool publishHassEntity(uint8_t ina, uint8_t entity)
+{
+  JsonDocument & json = getScratchDocument();
+  static char mqttTopic[64];
+  static char mqttTemplate[256];
+
+  char component[16];
+  char entityId[16];
+  char entityName[16];
+
+  // Calculate the 1-based output index
+  uint8_t output = ina + 1;
+
+  switch (entity)
+  {
+    case HASS_ENTITY_SWITCH:
+      // Switch entity for turning outputs on/off
+      sprintf_P(component, PSTR("switch"));
+      sprintf_P(entityId, PSTR("output_%d"), output);
+      sprintf_P(entityName, PSTR("Output %d"), output);
+
+      json.clear();
+      hass.getDiscoveryJson(json, entityId);
+
+      json["name"] = entityName;
+      json["dev_cla"] = "outlet";
+      json["cmd_t"] = oxrs.getMQTT()->getCommandTopic(mqttTopic);
+      json["stat_t"] = oxrs.getMQTT()->getStatusTopic(mqttTopic);
+      json["pl_on"] = "on";
+      json["pl_off"] = "off";
+
+      sprintf_P(mqttTemplate, PSTR("{'outputs':[{'index':%d,'command':'{{ value }}'}]}"), output);
+      json["cmd_tpl"] = mqttTemplate;
+
+      sprintf_P(mqttTemplate, PSTR("{%% if value_json.index == %d and value_json.type == 'relay' %%}{{ value_json.event }}{%% endif %%}"), output);
+      json["val_tpl"] = mqttTemplate;
+      break;
+
+    case HASS_ENTITY_MA:
+    case HASS_ENTITY_MV:
+    case HASS_ENTITY_MW:
+    {
+      // Sensor entities for mA/mV/mW telemetry
+      const char * units = entity == HASS_ENTITY_MA ? "mA" : entity == HASS_ENTITY_MV ? "mV" : "mW";
+      const char * deviceClass = entity == HASS_ENTITY_MA ? "current" : entity == HASS_ENTITY_MV ? "voltage" : "power";
+
+      sprintf_P(component, PSTR("sensor"));
+      sprintf_P(entityId, PSTR("%s_sensor_%d"), units, output);
+      sprintf_P(entityName, PSTR("%s Sensor %d"), units, output);
+
+      json.clear();
+      hass.getDiscoveryJson(json, entityId);
+
+      json["name"] = entityName;
+      json["dev_cla"] = deviceClass;
+      json["unit_of_meas"] = units;
+      json["stat_t"] = getOutputTelemetryTopic(mqttTopic, output);
+
+      // On-change payloads only carry the outputs which changed, so keep the
+      // current state for any output missing from the combined payload
+      if (g_publishTelemetryPerOutput)
+      {
+        sprintf_P(mqttTemplate, PSTR("{{ value_json.%s }}"), units);
+      }
+      else if (g_publishTelemetryCompact)
+      {
+        sprintf_P(mqttTemplate, PSTR("{{ value_json.%s[value_json.index.index(%d)] if %d in value_json.index else this.state }}"), units, output, output);
+      }
+      else
+      {
+        sprintf_P(mqttTemplate, PSTR("{%% set o = value_json | selectattr('index', 'equalto', %d) | list %%}{{ o[0].%s if o else this.state }}"), output, units);
+      }
+      json["val_tpl"] = mqttTemplate;
+      break;
+    }
+
+    case HASS_ENTITY_ALERT:
+      // Sensor entity for alert state
+      sprintf_P(component, PSTR("sensor"));
+      sprintf_P(entityId, PSTR("alert_%d"), output);
+      sprintf_P(entityName, PSTR("Alert %d"), output);
+
+      json.clear();
+      hass.getDiscoveryJson(json, entityId);
+
+      json["name"] = entityName;
+      json["dev_cla"] = "enum";
+      json["stat_t"] = oxrs.getMQTT()->getStatusTopic(mqttTopic);
+
+      sprintf_P(mqttTemplate, PSTR("{%% if value_json.index == %d and value_json.type == 'alert' %%}{{ value_json.event }}{%% endif %%}"), output);
+      json["val_tpl"] = mqttTemplate;
+      break;
+  }
+
+  if (!hass.publishDiscoveryJson(json, component, entityId))
+  {
+    oxrs.print(F("[pdu ] failed to publish discovery config for "));
+    oxrs.println(entityId);
+    return false;
+  }
+
+  return true;
+}
+
+void publishHassDiscovery()
+{
+  // Publish a few entities per loop rather than one big burst, so the
+  // control loop and broker aren't swamped on connect
+  uint8_t published = 0;
+
+  for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
+  {
+    uint8_t ina = g_scanner.inaList[i];
+
+    for (uint8_t entity = 0; entity < HASS_ENTITY_COUNT; entity++)
+    {
+      // Ignore if we have already published the discovery config for this entity
+      if (bitRead(g_hassDiscoveryPublished[ina], entity))
+        continue;
+
+      if (published >= g_hassDiscoveryPerLoop)
+        return;
+
+      // Time the whole burst
+      if (g_hassDiscoveryCount == 0)
+      {
+        g_hassDiscoveryStart = millis();
+      }
+
+      // Leave anything which failed to be retried on a later loop
+      published++;
+      if (!publishHassEntity(ina, entity))
+        return;
+
+      bitWrite(g_hassDiscoveryPublished[ina], entity, 1);
+      g_hassDiscoveryCount++;
+    }
+  }
+
+  // Report once everything outstanding has been published
+  if (g_hassDiscoveryCount > 0)
+  {
+    oxrs.print(F("[pdu ] published "));
+    oxrs.print(g_hassDiscoveryCount);
+    oxrs.print(F(" discovery configs in "));
+    oxrs.print(millis() - g_hassDiscoveryStart);
+    oxrs.println(F("ms"));
+
+    g_hassDiscoveryCount = 0;
+  }
+}
+
+/**
+  Event handlers
+*/
+void outputEvent(uint8_t id, uint8_t output, uint8_t type, uint8_t state)
+{
+  // Update the output shadow - i.e. turn the relay on/off once written
+  setOutput(output, state);
+
+  // Remember what we were last told, to restore after a reboot
+  journalRelayState(output, state);
+
+  // Drop it from the power-on sequence, if queued
+  g_sequenceRequested.fetch_and(~(1 << output));
+  g_sequenceCancelled.fetch_or(1 << output);
+
+  // Publish an event (index is 1-based)
+  publishOutputEvent(output + 1, type, state);
+
+  // Clear the *last alert type* so any subsequent alert triggers
+  g_alertRearm.fetch_or(1 << output);
+
+  // Start the inrush window if switching on
+  if (state == RELAY_ON)
+  {
+    g_outputsSwitchedOn.fetch_or(1 << output);
+  }
+}
+
+void inputEvent(uint8_t id, uint8_t input, uint8_t type, uint8_t state)
+{
+  // Check the input corresponds to an existing INA260 (we always read all 16 pins on
+  // the input MCP so just ignore any events for those without a corresponding output)
+  if (bitRead(g_scanner.inasFound, input) == 0)
+    return;
+
+  // Pass this event straight thru to the output handler, using same index
+  uint8_t outputType = RELAY;
+  uint8_t outputState = state == LOW_EVENT ? RELAY_ON : RELAY_OFF;
+
+  outputEvent(MCP_OUTPUT_INDEX, input, outputType, outputState);
+}
+
+bool readInaRegister(uint8_t ina, uint8_t reg, uint16_t * value)
+{
+  i2cStats_t * stats = &g_inaI2cStats[ina];
+  stats->transactions++;
+
+  // Single write-pointer/repeated-start/read transaction, 5 bytes on the bus
+  Wire.beginTransmission(INA_I2C_ADDRESS[ina]);
+  Wire.write(reg);
+
+  // 2 and 3 are address and data NACKs
+  uint8_t result = Wire.endTransmission(false);
+  if (result != 0)
+  {
+    stats->errors++;
+    if (result == 2 || result == 3) { stats->nacks++; }
+    return false;
+  }
+
+  if (Wire.requestFrom(INA_I2C_ADDRESS[ina], (uint8_t)2) != 2)
+  {
+    stats->errors++;
+    return false;
+  }
+
+  uint8_t msb = Wire.read();
+  uint8_t lsb = Wire.read();
+  *value = (msb << 8) | lsb;
+  return true;
+}
+
+bool WirePduBus::readRegister(uint8_t ina, uint8_t reg, uint16_t * value)
+{
+  return readInaRegister(ina, reg, value);
+}
+
+bool WirePduBus::isOutputOn(uint8_t output)
+{
+  return ::isOutputOn(output);
+}
+
+void WirePduBus::setOutput(uint8_t output, bool on)
+{
+  ::setOutput(output, on ? RELAY_ON : RELAY_OFF);
+}
+
+void WirePduBus::writeOutputs()
+{
+  ::writeOutputs();
+}
+
+void resetProtection(uint8_t ina)
+{
+  protection_t * protection = &g_scanner.protection[ina];
+
+  protection->limit_mA = DEFAULT_OVERCURRENT_MA;
+  protection->instantLimit_mA = 0;
+  protection->tripDelay_ms = 0;
+  protection->inrush_mA = 0;
+  protection->inrushTime_ms = 0;
+  protection->retryCount = 0;
+  protection->retryDelay_s = 5;
+  protection->priority = 0;
+
+  protection->overload = 0LL;
+  protection->lastSample = 0L;
+  protection->onTime = millis();
+  protection->retryTime = 0L;
+  protection->retries = 0;
+  protection->shed_mA = 0;
+}
+
+void pushInaFrame(inaFrame_t * frame)
+{
+  // Alerts and trips must reach loop() even if a frame has to be dropped,
+  // so carry them forward until a frame makes it into the ring
+  for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+  {
+    if (bitRead(g_unsentAlerts, ina) && !bitRead(frame->newAlerts, ina))
+    {
+      frame->alertType[ina] = g_unsentAlertType[ina];
+    }
+  }
+  frame->newAlerts |= g_unsentAlerts;
+  frame->tripped |= g_unsentTrips;
+  frame->restored |= g_unsentRestores;
+  frame->tripLatency_us = max(frame->tripLatency_us, g_unsentTripLatency_us);
+
+  if (!g_inaFrames.push(*frame))
+  {
+    // loop() has fallen behind, drop this frame
+    g_inaFramesDropped++;
+
+    g_unsentAlerts = frame->newAlerts;
+    g_unsentTrips = frame->tripped;
+    g_unsentRestores = frame->restored;
+    g_unsentTripLatency_us = frame->tripLatency_us;
+    memcpy(g_unsentAlertType, frame->alertType, sizeof(g_unsentAlertType));
+    return;
+  }
+
+  g_unsentAlerts = 0;
+  g_unsentTrips = 0;
+  g_unsentRestores = 0;
+  g_unsentTripLatency_us = 0L;
+}
+
+void freezeRecorder()
+{
+  // Copy out oldest first, so the live history can keep rolling
+  for (uint8_t i = 0; i < RECORDER_SAMPLE_COUNT; i++)
+  {
+    uint8_t row = (g_recorderHead + i) % RECORDER_SAMPLE_COUNT;
+
+    g_recorderSnapshot.timestamp[i] = g_recorder.timestamp[row];
+    memcpy(g_recorderSnapshot.mA[i], g_recorder.mA[row], sizeof(g_recorder.mA[row]));
+    memcpy(g_recorderSnapshot.mV[i], g_recorder.mV[row], sizeof(g_recorder.mV[row]));
+  }
 
-  // NOTE: the PDU relays are NC - so LOW is on, HIGH is off
-  publishOutputEvent(index, RELAY, state == LOW ? RELAY_ON : RELAY_OFF);
+  g_recorderSamples = min(g_recorderHead, (uint32_t)RECORDER_SAMPLE_COUNT);
+  g_recorderOutputs.store(g_recorderTriggered, std::memory_order_release);
+  g_recorderTriggered = 0;
 }
 
-void jsonOutputCommand(JsonVariant json)
+void recordFrame(inaFrame_t * frame)
 {
-  // Index is 1-based
-  uint8_t index = getIndex(json);
-  if (index == 0) return;
+  // Add this scan to the rolling history
+  uint8_t row = g_recorderHead % RECORDER_SAMPLE_COUNT;
+  g_recorder.timestamp[row] = frame->timestamp;
+  for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+  {
+    g_recorder.mA[row][ina] = constrain(frame->mA[ina], INT16_MIN, INT16_MAX);
+    g_recorder.mV[row][ina] = min(frame->mV[ina], (uint32_t)UINT16_MAX);
+  }
+  g_recorderHead++;
 
-  if (json["command"].is<const char *>())
+  // Any alerts (including interrupt driven trips since the last scan) trigger
+  // a recording, or join the one already in progress
+  uint16_t triggered = frame->newAlerts | frame->tripped | g_recorderInterruptTrips;
+  g_recorderInterruptTrips = 0;
+
+  bool started = false;
+  if (triggered != 0)
   {
-    if (json["command"].isNull() || strcmp(json["command"], "query") == 0)
-    {
-      // Publish a status event with the current state
-      queryOutputState(index);
-    }
-    else
+    if (g_recorderTriggered == 0)
     {
-      // Send this command down to our output handler to process
-      if (strcmp(json["command"], "on") == 0)
+      // Can't overwrite a snapshot loop() is still publishing
+      if (g_recorderOutputs.load(std::memory_order_acquire) != 0)
       {
-        oxrsOutput.handleCommand(MCP_OUTPUT_INDEX, index - 1, RELAY_ON);
+        g_recorderMissed++;
+        triggered = 0;
       }
-      else if (strcmp(json["command"], "off") == 0)
+      else
       {
-        oxrsOutput.handleCommand(MCP_OUTPUT_INDEX, index - 1, RELAY_OFF);
+        g_recorderTriggerTime = frame->timestamp;
+        g_recorderPostSamples = RECORDER_POST_SAMPLES;
+        started = true;
       }
-      else 
+    }
+
+    for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+    {
+      if (bitRead(triggered, ina) && !bitRead(g_recorderTriggered, ina))
       {
-        oxrs.println(F("[pdu ] invalid command"));
+        g_recorderAlertType[ina] = frame->alertType[ina] == ALERT_TYPE_NONE ? ALERT_TYPE_I_OVER : frame->alertType[ina];
       }
     }
+
+    g_recorderTriggered |= triggered;
   }
-}
 
-void jsonCommand(JsonVariant json)
-{
-  if (json.containsKey("queryOutputs"))
+  // Freeze once we have enough scans after the first trigger
+  if (g_recorderTriggered != 0 && !started && --g_recorderPostSamples == 0)
   {
-    g_queryOutputs = json["queryOutputs"].as<bool>();
+    freezeRecorder();
   }
+}
 
-  if (json["outputs"].is<JsonArray>())
+void sampleInas()
+{
+  // Static so any sensor that fails to respond keeps its last reading
+  static inaFrame_t frame;
+  frame.timestamp = millis();
+  frame.sampled = 0;
+  frame.newAlerts = 0;
+  frame.tripped = 0;
+  frame.restored = 0;
+  frame.tripLatency_us = 0L;
+
+  // Clear the *last alert type* and any pending retries for outputs changed
+  // by loop(), and start the inrush window for any switched on
+  uint16_t rearm = g_alertRearm.exchange(0);
+  uint16_t switchedOn = g_outputsSwitchedOn.exchange(0);
+
+  // Pick up any outputs queued for, or dropped from, the power-on sequence
+  g_scanner.sequencePending &= ~g_sequenceCancelled.exchange(0);
+  g_scanner.sequencePending |= g_sequenceRequested.exchange(0);
+  for (uint8_t ina = 0; ina < INA_COUNT; ina++)
   {
-    for (JsonVariant output : json["outputs"].as<JsonArray>())
+    if (bitRead(rearm, ina))
+    {
+      g_scanner.lastAlertType[ina] = ALERT_TYPE_NONE;
+      g_scanner.protection[ina].retryTime = 0L;
+      g_scanner.protection[ina].retries = 0;
+      bitWrite(g_scanner.shedOutputs, ina, 0);
+    }
+
+    if (bitRead(switchedOn, ina))
     {
-      jsonOutputCommand(output);
+      g_scanner.protection[ina].onTime = frame.timestamp;
+      g_scanner.protection[ina].overload = 0LL;
     }
   }
 
-  // Pass on to the fan control library
-  fan.onCommand(json);
+  // Protection, load shedding and sequencing all happen in a single sweep
+  lockI2C();
+  g_scanner.sweep(&frame);
+  unlockI2C();
+
+  // Keep the flight recorder rolling
+  recordFrame(&frame);
+
+  // Hand this scan over to loop()
+  pushInaFrame(&frame);
 }
 
-void publishHassDiscovery()
+void IRAM_ATTR inaAlertIsr()
 {
-  char component[16];
+  // Timestamp the first edge and wake the sensor task immediately
+  if (g_inaAlertTime_us == 0L)
+  {
+    g_inaAlertTime_us = micros();
+  }
 
-  char entityId[16];
-  char entityName[16];
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(g_sensorTask, &higherPriorityTaskWoken);
+  if (higherPriorityTaskWoken) { portYIELD_FROM_ISR(); }
+}
 
-  char mqttTopic[64];
-  char mqttTemplate[256];
+void tripAlertedInas(uint16_t outputs)
+{
+  lockI2C();
 
-  for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+  // Only outputs which are on can be drawing current, so only those
+  // sensors need their alert flag checked
+  for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
   {
-    if (bitRead(g_inasFound, ina) == 0)
+    uint8_t ina = g_scanner.inaList[i];
+    if (!bitRead(outputs, ina) || !isOutputOn(ina))
       continue;
 
-    // Ignore if we have already published the discovery config for this input
-    if (g_hassDiscoveryPublished[ina])
+    uint16_t maskEnable;
+    if (!readInaRegister(ina, INA260_REG_MASK_ENABLE, &maskEnable) || !(maskEnable & INA260_MASK_ENABLE_AFF))
       continue;
 
-    // Calculate the 1-based output index
-    uint8_t output = ina + 1;
-
-    // Switch entity for turning outputs on/off
-    sprintf_P(component, PSTR("switch"));
-    sprintf_P(entityId, PSTR("output_%d"), output);
-    sprintf_P(entityName, PSTR("Output %d"), output);
-
-    JsonDocument switchJson;
-    hass.getDiscoveryJson(switchJson, entityId);
-
-    switchJson["name"] = entityName;
-    switchJson["dev_cla"] = "outlet";
-    switchJson["cmd_t"] = oxrs.getMQTT()->getCommandTopic(mqttTopic);
-    switchJson["stat_t"] = oxrs.getMQTT()->getStatusTopic(mqttTopic);
-    switchJson["pl_on"] = "on";
-    switchJson["pl_off"] = "off";
-
-    sprintf_P(mqttTemplate, PSTR("{'outputs':[{'index':%d,'command':'{{ value }}'}]}"), output);
-    switchJson["cmd_tpl"] = mqttTemplate;
-
-    sprintf_P(mqttTemplate, PSTR("{%% if value_json.index == %d and value_json.type == 'relay' %%}{{ value_json.event }}{%% endif %%}"), output);
-    switchJson["val_tpl"] = mqttTemplate;
-
-    if (!hass.publishDiscoveryJson(switchJson, component, entityId))
-    {
-      oxrs.print(F("[pdu ] failed to publish switch discovery config for output "));
-      oxrs.print(output);
-      oxrs.println();
-    }
-
-    // Sensor entity for mA telemetry
-    sprintf_P(component, PSTR("sensor"));
-    sprintf_P(entityId, PSTR("mA_sensor_%d"), output);
-    sprintf_P(entityName, PSTR("mA Sensor %d"), output);
+    // Cut the relay, loop() publishes the events
+    setOutput(ina, RELAY_OFF);
+    bitWrite(g_unsentTrips, ina, 1);
+    bitWrite(g_recorderInterruptTrips, ina, 1);
 
-    JsonDocument mAJson;
-    hass.getDiscoveryJson(mAJson, entityId);
+    g_scanner.protection[ina].overload = 0LL;
+    scheduleRetry(&g_scanner.protection[ina], millis());
 
-    mAJson["name"] = entityName;
-    mAJson["dev_cla"] = "current";
-    mAJson["unit_of_meas"] = "mA";
-    mAJson["stat_t"] = oxrs.getMQTT()->getTelemetryTopic(mqttTopic);
-
-    sprintf_P(mqttTemplate, PSTR("{{ (value_json | selectattr('index', 'equalto', %d) | list)[0].mA }}"), output);
-    mAJson["val_tpl"] = mqttTemplate;
-
-    if (!hass.publishDiscoveryJson(mAJson, component, entityId))
+    if (g_scanner.lastAlertType[ina] != ALERT_TYPE_I_OVER)
     {
-      oxrs.print(F("[pdu ] failed to publish mA sensor discovery config for output "));
-      oxrs.print(output);
-      oxrs.println();
+      bitWrite(g_unsentAlerts, ina, 1);
+      g_unsentAlertType[ina] = ALERT_TYPE_I_OVER;
+      g_scanner.lastAlertType[ina] = ALERT_TYPE_I_OVER;
     }
+  }
 
-    // Sensor entity for mV telemetry
-    sprintf_P(component, PSTR("sensor"));
-    sprintf_P(entityId, PSTR("mV_sensor_%d"), output);
-    sprintf_P(entityName, PSTR("mV Sensor %d"), output);
+  // Write every tripped relay in one go
+  writeOutputs();
+  unlockI2C();
 
-    JsonDocument mVJson;
-    hass.getDiscoveryJson(mVJson, entityId);
+  // Measure from the interrupt edge to the relays being off
+  if (g_inaAlertTime_us > 0L)
+  {
+    g_tripLatencyLast_us = micros() - g_inaAlertTime_us;
+    g_tripLatencyMax_us = max(g_tripLatencyMax_us, g_tripLatencyLast_us);
+    g_unsentTripLatency_us = max(g_unsentTripLatency_us, g_tripLatencyLast_us);
+    g_inaAlertTime_us = 0L;
+  }
+}
 
-    mVJson["name"] = entityName;
-    mVJson["dev_cla"] = "voltage";
-    mVJson["unit_of_meas"] = "mV";
-    mVJson["stat_t"] = oxrs.getMQTT()->getTelemetryTopic(mqttTopic);
+void setInaConversion(uint8_t ina, bool fast)
+{
+  // Minimum averaging and conversion time while capturing, defaults otherwise
+  ina260[ina].setAveragingCount(fast ? INA260_COUNT_1 : g_inaAveragingCount);
+  ina260[ina].setVoltageConversionTime(fast ? INA260_TIME_140_us : g_inaConversionTime);
+  ina260[ina].setCurrentConversionTime(fast ? INA260_TIME_140_us : g_inaConversionTime);
+}
 
-    sprintf_P(mqttTemplate, PSTR("{{ (value_json | selectattr('index', 'equalto', %d) | list)[0].mV }}"), output);
-    mVJson["val_tpl"] = mqttTemplate;
+uint32_t getInaCycleTime()
+{
+  // Current and bus voltage are converted in turn, each averaged over the count
+  uint32_t conversion_us = 2L * INA_AVERAGING_COUNTS[g_inaAveragingCount] * INA_CONVERSION_TIMES_US[g_inaConversionTime];
+  return constrain(conversion_us / 1000L + INA_CYCLE_MARGIN, INA_MIN_CYCLE_TIME, INA_MAX_CYCLE_TIME);
+}
 
-    if (!hass.publishDiscoveryJson(mVJson, component, entityId))
-    {
-      oxrs.print(F("[pdu ] failed to publish mV sensor discovery config for output "));
-      oxrs.print(output);
-      oxrs.println();
-    }
+void applyInaConversion()
+{
+  lockI2C();
+  for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
+  {
+    uint8_t ina = g_scanner.inaList[i];
 
-    // Sensor entity for mW telemetry
-    sprintf_P(component, PSTR("sensor"));
-    sprintf_P(entityId, PSTR("mW_sensor_%d"), output);
-    sprintf_P(entityName, PSTR("mW Sensor %d"), output);
+    // Any capture in progress restores the new settings when it finishes
+    if (ina == g_captureIna && g_captureState.load(std::memory_order_acquire) == CAPTURE_RUNNING)
+      continue;
 
-    JsonDocument mWJson;
-    hass.getDiscoveryJson(mWJson, entityId);
+    setInaConversion(ina, false);
+  }
+  unlockI2C();
 
-    mWJson["name"] = entityName;
-    mWJson["dev_cla"] = "power";
-    mWJson["unit_of_meas"] = "mW";
-    mWJson["stat_t"] = oxrs.getMQTT()->getTelemetryTopic(mqttTopic);
+  g_inaCycleTime_ms = getInaCycleTime();
+}
 
-    sprintf_P(mqttTemplate, PSTR("{{ (value_json | selectattr('index', 'equalto', %d) | list)[0].mW }}"), output);
-    mWJson["val_tpl"] = mqttTemplate;
+void captureSamples(uint32_t lastScan)
+{
+  uint8_t ina = g_captureIna;
 
-    if (!hass.publishDiscoveryJson(mWJson, component, entityId))
+  // Poll for each new conversion until the next scan is nearly due, the
+  // scan itself keeps every output (including this one) protected
+  uint32_t window = g_inaCycleTime_ms - CAPTURE_SCAN_MARGIN_MS;
+  while ((millis() - lastScan) < window && g_captureCount < CAPTURE_SAMPLE_COUNT)
+  {
+    // Never hold up an interrupt driven trip
+    if (ulTaskNotifyTake(pdTRUE, 0) > 0)
     {
-      oxrs.print(F("[pdu ] failed to publish mW sensor discovery config for output "));
-      oxrs.print(output);
-      oxrs.println();
+      tripAlertedInas(g_scanner.inasFound);
     }
 
-    // Sensor entity for alert state
-    sprintf_P(component, PSTR("sensor"));
-    sprintf_P(entityId, PSTR("alert_%d"), output);
-    sprintf_P(entityName, PSTR("Alert %d"), output);
-
-    JsonDocument alertJson;
-    hass.getDiscoveryJson(alertJson, entityId);
-
-    alertJson["name"] = entityName;
-    alertJson["dev_cla"] = "enum";
-    alertJson["stat_t"] = oxrs.getMQTT()->getStatusTopic(mqttTopic);
+    // Reading the mask/enable register clears the conversion ready flag
+    uint16_t maskEnable, current, voltage;
+    uint32_t pollStart = micros();
 
-    sprintf_P(mqttTemplate, PSTR("{%% if value_json.index == %d and value_json.type == 'alert' %%}{{ value_json.event }}{%% endif %%}"), output);
-    alertJson["val_tpl"] = mqttTemplate;
+    lockI2C();
+    bool ready = readInaRegister(ina, INA260_REG_MASK_ENABLE, &maskEnable) &&
+                 (maskEnable & INA260_MASK_ENABLE_CVRF) &&
+                 readInaRegister(ina, INA260_REG_CURRENT, &current) &&
+                 readInaRegister(ina, INA260_REG_BUSVOLTAGE, &voltage);
+    unlockI2C();
 
-    if (!hass.publishDiscoveryJson(alertJson, component, entityId))
+    if (ready)
     {
-      oxrs.print(F("[pdu ] failed to publish alert sensor discovery config for output "));
-      oxrs.print(output);
-      oxrs.println();
+      captureSample_t * sample = &g_captureSamples[g_captureCount++];
+      sample->time_us = micros() - g_captureStart_us;
+      sample->current = (int16_t)current;
+      sample->voltage = voltage;
     }
 
-    g_hassDiscoveryPublished[ina] = true;
+    uint32_t pollTime = micros() - pollStart;
+    uint32_t wait = pollTime < CAPTURE_POLL_US ? CAPTURE_POLL_US - pollTime : 0L;
+    delayMicroseconds(max(wait, (uint32_t)CAPTURE_POLL_GAP_US));
   }
 }
 
-/**
-  Event handlers
-*/
-void outputEvent(uint8_t id, uint8_t output, uint8_t type, uint8_t state)
+void runCapture(uint32_t lastScan)
 {
-  // Update the MCP pin - i.e. turn the relay on/off
-  // NOTE: the PDU relays are NC - so LOW to turn on, HIGH to turn off
-  mcp23017[id].digitalWrite(output, state == RELAY_ON ? LOW : HIGH);
+  uint8_t state = g_captureState.load(std::memory_order_acquire);
 
-  // Publish an event (index is 1-based)
-  publishOutputEvent(output + 1, type, state);
+  if (state == CAPTURE_REQUESTED)
+  {
+    lockI2C();
+    setInaConversion(g_captureIna, true);
+    unlockI2C();
 
-  // Clear the *last alert type* so any subsequent alert triggers
-  g_lastAlertType[output] = ALERT_TYPE_NONE;
-}
+    g_captureCount = 0;
+    g_captureStart = millis();
+    g_captureStart_us = micros();
 
-void inputEvent(uint8_t id, uint8_t input, uint8_t type, uint8_t state)
-{
-  // Check the input corresponds to an existing INA260 (we always read all 16 pins on
-  // the input MCP so just ignore any events for those without a corresponding output)
-  if (bitRead(g_inasFound, input) == 0)
+    state = CAPTURE_RUNNING;
+    g_captureState.store(state, std::memory_order_release);
+  }
+
+  if (state != CAPTURE_RUNNING)
     return;
 
-  // Pass this event straight thru to the output handler, using same index
-  uint8_t outputType = RELAY;
-  uint8_t outputState = state == LOW_EVENT ? RELAY_ON : RELAY_OFF;
+  captureSamples(lastScan);
 
-  outputEvent(MCP_OUTPUT_INDEX, input, outputType, outputState);
+  // Restore the normal settings and hand the samples over to loop()
+  if (g_captureCount >= CAPTURE_SAMPLE_COUNT || (millis() - g_captureStart) > CAPTURE_TIMEOUT_MS)
+  {
+    lockI2C();
+    setInaConversion(g_captureIna, false);
+    unlockI2C();
+
+    g_captureState.store(CAPTURE_COMPLETE, std::memory_order_release);
+  }
 }
 
-void processInas()
+void sensorTask(void * parameter)
 {
-  if ((millis() - g_inaTimer) > INA_CYCLE_TIME)
-  {
-    g_inaTimer = millis();
-    
-    float mA[INA_COUNT];
-    float mV[INA_COUNT];
-    float mW[INA_COUNT];
-    uint8_t alertType[INA_COUNT];
+  uint32_t lastScan = millis();
 
-    float mATotal = 0;
-
-    // Iterate through each of the INA260s found on the I2C bus
-    for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+  for (;;)
+  {
+    // Pick up any change to the averaging/conversion config
+    if (g_inaConversionChanged.exchange(false))
     {
-      if (bitRead(g_inasFound, ina) == 0)
-        continue;
+      applyInaConversion();
+    }
 
-      // Read the values for this sensor
-      mA[ina] = ina260[ina].readCurrent();
-      mV[ina] = ina260[ina].readBusVoltage();
-      mW[ina] = ina260[ina].readPower();
+    // Use the time between scans for any waveform capture
+    runCapture(lastScan);
 
-      // We are using the internal over-current alert type
-      alertType[ina] = ina260[ina].alertFunctionFlag() ? ALERT_TYPE_I_OVER : ALERT_TYPE_NONE;
+    // Sleep until the next scan is due, or until the alert interrupt fires
+    uint32_t elapsed = millis() - lastScan;
+    TickType_t wait = elapsed < g_inaCycleTime_ms ? pdMS_TO_TICKS(g_inaCycleTime_ms - elapsed) : 0;
 
-      // Keep track of total current
-      mATotal += mA[ina];
+    if (ulTaskNotifyTake(pdTRUE, wait) > 0)
+    {
+      tripAlertedInas(g_scanner.inasFound);
     }
 
-    // Check for any alerted outputs and shut them off
-    for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+    // Fixed cadence, independent of whatever loop() is busy with
+    uint32_t sinceScan = millis() - lastScan;
+    if (sinceScan >= g_inaCycleTime_ms)
     {
-      if (bitRead(g_inasFound, ina) == 0)
-        continue;
+      // Count any whole cycles we were too late for
+      if (sinceScan >= 2 * g_inaCycleTime_ms)
+      {
+        g_inaScansMissed += sinceScan / g_inaCycleTime_ms - 1;
+      }
 
-      // Check for any manual alert states if not already alerted
-      if (alertType[ina] == ALERT_TYPE_NONE)
+      lastScan = millis();
+
+      uint32_t startCycles = ESP.getCycleCount();
+#if !defined(INA_ALERT_PIN)
+      // No alert interrupt to wake us, so check the alert flags of any outputs
+      // adaptive scanning skips this cycle (the scan trips the rest from their
+      // readings, so this costs nothing when every output is read every scan)
+      uint16_t skipped = 0;
+      for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
       {
-        // Check bus voltage limits and set manual alert states
-        int voltageCheck = checkVoltageLimits(mV[ina]);
-        if (voltageCheck < 0)
-        {
-          // Under-voltage alert
-          alertType[ina] = ALERT_TYPE_V_UNDER;
-        }
-        else if (voltageCheck > 0)
-        {
-          // Over-voltage alert
-          alertType[ina] = ALERT_TYPE_V_OVER;
-        }      
-        else if (mATotal >= g_overCurrentLimit_mA)
+        uint8_t ina = g_scanner.inaList[i];
+        if (isOutputOn(ina) && !g_scanner.isScanDue(ina, lastScan))
         {
-          // Total over-current alert
-          alertType[ina] = ALERT_TYPE_I_OVER_TOTAL;
+          bitWrite(skipped, ina, 1);
         }
       }
 
-      // Check for any new alert states
-      if (alertType[ina] != ALERT_TYPE_NONE && alertType[ina] != g_lastAlertType[ina])
+      if (skipped != 0)
       {
-        // Turn off relay if it is currently on
-        // NOTE: the PDU relays are NC - so LOW to turn on, HIGH to turn off
-        if (LOW == mcp23017[MCP_OUTPUT_INDEX].digitalRead(ina))
+        tripAlertedInas(skipped);
+      }
+#endif
+      sampleInas();
+      recordStage(STAGE_SENSOR_SCAN, startCycles);
+
+      if (g_bootFirstSample_ms == 0L)
+      {
+        g_bootFirstSample_ms = millis();
+      }
+    }
+  }
+}
+
+void processInas()
+{
+  inaFrame_t * frame;
+
+  // Drain every frame the sensor task has handed over
+  while ((frame = g_inaFrames.peek()) != nullptr)
+  {
+    for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
+    {
+      uint8_t ina = g_scanner.inaList[i];
+
+      // Accumulate telemetry window statistics (unless telemetry is disabled)
+      if (bitRead(frame->sampled, ina) && g_publishTelemetry_ms > 0)
+      {
+        updateOutputStats(ina, frame->mA[ina], frame->mV[ina], frame->mW[ina]);
+
+        if (g_publishTelemetryOnChange)
         {
-          outputEvent(MCP_OUTPUT_INDEX, ina, RELAY, RELAY_OFF);
+          checkTelemetryChanged(frame, ina);
         }
+      }
+
+      // Meter energy from every sample
+      if (bitRead(frame->sampled, ina))
+      {
+        updateOutputEnergy(ina, frame->timestamp, frame->mW[ina]);
+      }
+
+      // Publish an event for any relay the sensor task turned back on (index is 1-based)
+      if (bitRead(frame->restored, ina))
+      {
+        publishOutputEvent(ina + 1, RELAY, RELAY_ON);
+        g_energyCheckpointDue = true;
+      }
 
-        // Publish an alert event (index is 1-based)
-        publishAlertEvent(ina + 1, alertType[ina]);
+      // Publish an event for any relay the sensor task turned off
+      if (bitRead(frame->tripped, ina))
+      {
+        publishOutputEvent(ina + 1, RELAY, RELAY_OFF);
+        g_energyCheckpointDue = true;
+      }
+
+      // Publish an alert event (index is 1-based)
+      if (bitRead(frame->newAlerts, ina))
+      {
+        publishAlertEvent(ina + 1, frame->alertType[ina]);
       }
+    }
+
+    // Report how quickly any interrupt driven trip cut the relays
+    if (frame->tripLatency_us > 0L)
+    {
+      oxrs.print(F("[pdu ] alert trip latency "));
+      oxrs.print(frame->tripLatency_us);
+      oxrs.print(F("us (max "));
+      oxrs.print(g_tripLatencyMax_us);
+      oxrs.println(F("us)"));
+    }
 
-      // Update the *last alert type*
-      g_lastAlertType[ina] = alertType[ina];
-    }    
+    // Publish telemetry data if required (the last frame is still
+    // owned by us until it is popped)
+    if (g_inaFrames.count() == 1)
+    {
+      publishTelemetry(frame);
+    }
+
+    g_inaFrames.pop();
+  }
 
-    // Publish telemetry data if required
-    publishTelemetry(mA, mV, mW);
+  // Check if we are querying the energy counters
+  if (g_queryEnergy)
+  {
+    publishEnergy();
+    g_queryEnergy = false;
   }
+
+  // Persist the energy counters if required
+  checkpointEnergy(false);
+}
+
+bool isInputChanged()
+{
+#if defined(MCP_INPUT_INT_PIN)
+  // The interrupt line stays asserted until the GPIO is read, so checking the
+  // level can't miss a change (reading also clears the interrupt)
+  if (digitalRead(MCP_INPUT_INT_PIN) == LOW)
+    return true;
+
+  return (millis() - g_lastInputRead) >= MCP_INPUT_POLL_MS;
+#else
+  return (millis() - g_lastInputRead) >= MCP_INPUT_SCAN_MS;
+#endif
 }
 
 void processMcps()
@@ -779,17 +2612,35 @@ void processMcps()
     // Check for any input events
     if (mcp == MCP_INPUT_INDEX)
     {
-      oxrsInput.process(mcp, mcp23017[mcp].readGPIOAB());    
+      // Only read the inputs when they might have changed, but always pass the
+      // last value to the input handler so its debounce timing carries on
+      if (isInputChanged())
+      {
+        lockI2C();
+        g_inputValue = mcp23017[mcp].readGPIOAB();
+        g_mcpI2cStats[mcp].transactions++;
+        unlockI2C();
+
+        g_lastInputRead = millis();
+        g_inputReads++;
+      }
+
+      oxrsInput.process(mcp, g_inputValue);
     }
   }
 
+  // Write any relay changes from the output/input handlers in one go
+  writeOutputs();
+
+  // Journal the commanded relay states if required
+  checkpointRelayState();
+
   // Check if we are querying the current states
   if (g_queryOutputs)
   {
-    for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+    for (uint8_t i = 0; i < g_scanner.inaListCount; i++)
     {
-      if (bitRead(g_inasFound, ina) == 0)
-        continue;
+      uint8_t ina = g_scanner.inaList[i];
   
       // Output index is 1-based
       queryOutputState(ina + 1);
@@ -802,61 +2653,27 @@ void processMcps()
 void processFans()
 {
   // Let fan controllers handle any events etc
+  lockI2C();
   fan.loop();
+  unlockI2C();
 
-  // Publish fan telemetry
-  JsonDocument telemetry;
+  // Queue fan telemetry for publishing (only copied into the slot if there
+  // is any, so the pending payload isn't superseded every loop)
+  JsonDocument & telemetry = getScratchDocument();
   fan.getTelemetry(telemetry.as<JsonVariant>());
   
   if (telemetry.size() > 0)
   {
-    oxrs.publishTelemetry(telemetry.as<JsonVariant>());
+    getTelemetrySlot(TELEMETRY_SLOT_FAN).set(telemetry.as<JsonVariant>());
+    queueTelemetry(TELEMETRY_SLOT_FAN);
   }
 }
 
 /**
   I2C
  */
-void scanI2CBus()
+void scanMcps()
 {
-  // Initialise current sensors
-  oxrs.println(F("[pdu ] scanning for current sensors..."));
-
-  for (uint8_t ina = 0; ina < INA_COUNT; ina++)
-  {
-    oxrs.print(F(" - 0x"));
-    oxrs.print(INA_I2C_ADDRESS[ina], HEX);
-    oxrs.print(F("..."));
-
-    // Initialise the *last alert type*
-    g_lastAlertType[ina] = ALERT_TYPE_NONE;
-
-    if (ina260[ina].begin(INA_I2C_ADDRESS[ina]))
-    {
-      bitWrite(g_inasFound, ina, 1);
-      oxrs.println(F("INA260"));
-
-      // Set the number of samples to average
-      ina260[ina].setAveragingCount(DEFAULT_AVERAGING_COUNT);
-      
-      // Set the time over which to measure the current and bus voltage
-      ina260[ina].setVoltageConversionTime(DEFAULT_CONVERSION_TIME);
-      ina260[ina].setCurrentConversionTime(DEFAULT_CONVERSION_TIME);
-
-      // Set the polarity and disable latching so the alert resets
-      ina260[ina].setAlertPolarity(INA260_ALERT_POLARITY_NORMAL);
-      ina260[ina].setAlertLatch(INA260_ALERT_LATCH_TRANSPARENT);
-
-      // Default the over current alert at 2000mA (2A)
-      ina260[ina].setAlertType(INA260_ALERT_OVERCURRENT);
-      ina260[ina].setAlertLimit(DEFAULT_OVERCURRENT_MA);
-    }
-    else
-    {
-      oxrs.println(F("empty"));
-    }
-  }
-
   // Initialise I/O buffers
   oxrs.println(F("[pdu ] scanning for I/O buffers..."));
 
@@ -873,6 +2690,13 @@ void scanI2CBus()
       oxrs.println(F("MCP23017"));
   
       mcp23017[mcp].begin_I2C(MCP_I2C_ADDRESS[mcp]);
+
+      // Latch the output shadow before the pins are driven
+      if (mcp == MCP_OUTPUT_INDEX)
+      {
+        mcp23017[mcp].writeGPIOAB(g_outputShadow);
+      }
+
       for (uint8_t pin = 0; pin < MCP_PIN_COUNT; pin++)
       {
         mcp23017[mcp].pinMode(pin, mcp == MCP_OUTPUT_INDEX ? OUTPUT : INPUT_PULLUP);
@@ -881,11 +2705,36 @@ void scanI2CBus()
       if (mcp == MCP_OUTPUT_INDEX)
       {
         // Initialise the output handler (default to RELAY, not configurable)
-        // NOTE: the PDU relays are NC - so startup in ON state
-        oxrsOutput.begin(outputEvent, RELAY, RELAY_ON);
+        // NOTE: the PDU relays are NC by default - so startup in ON state
+        oxrsOutput.begin(outputEvent, RELAY, RELAY_POWER_ON_STATE);
+
+        // Bring the output handler in line with any restored states (the
+        // relays are already latched, this just publishes their events),
+        // outputs left to the power-on sequencer are published once closed
+        uint16_t sequence = g_sequenceRequested.load();
+        for (uint8_t output = 0; output < INA_COUNT; output++)
+        {
+          if (bitRead(sequence, output))
+            continue;
+
+          if (isOutputOn(output) != (RELAY_POWER_ON_STATE == RELAY_ON))
+          {
+            oxrsOutput.handleCommand(MCP_OUTPUT_INDEX, output, isOutputOn(output) ? RELAY_ON : RELAY_OFF);
+          }
+        }
       }
       if (mcp == MCP_INPUT_INDEX)
       {
+#if defined(MCP_INPUT_INT_PIN)
+        // Interrupt on any input change, INTA/INTB mirrored onto a single line
+        mcp23017[mcp].setupInterrupts(true, false, LOW);
+        for (uint8_t pin = 0; pin < MCP_PIN_COUNT; pin++)
+        {
+          mcp23017[mcp].setupInterruptPin(pin, CHANGE);
+        }
+        pinMode(MCP_INPUT_INT_PIN, INPUT_PULLUP);
+#endif
+
         // Initialise the input handler (default to SWITCH, not configurable)
         oxrsInput.begin(inputEvent, SWITCH);
       }
@@ -897,34 +2746,113 @@ void scanI2CBus()
   }
 }
 
+void scanInas()
+{
+  // Initialise current sensors
+  oxrs.println(F("[pdu ] scanning for current sensors..."));
+
+  for (uint8_t ina = 0; ina < INA_COUNT; ina++)
+  {
+    oxrs.print(F(" - 0x"));
+    oxrs.print(INA_I2C_ADDRESS[ina], HEX);
+    oxrs.print(F("..."));
+
+    // Initialise the *last alert type*, protection and telemetry statistics
+    g_scanner.lastAlertType[ina] = ALERT_TYPE_NONE;
+    resetProtection(ina);
+    resetOutputStats(ina);
+
+    // Quick probe first, so missing sensors cost a single NACK
+    Wire.beginTransmission(INA_I2C_ADDRESS[ina]);
+    if (Wire.endTransmission() == 0 && ina260[ina].begin(INA_I2C_ADDRESS[ina]))
+    {
+      bitWrite(g_scanner.inasFound, ina, 1);
+      g_scanner.inaList[g_scanner.inaListCount++] = ina;
+      oxrs.println(F("INA260"));
+
+      // Set the number of samples to average, and the time over which 
+      // to measure the current and bus voltage
+      setInaConversion(ina, false);
+
+      // Set the polarity and disable latching so the alert resets
+      ina260[ina].setAlertPolarity(INA260_ALERT_POLARITY_NORMAL);
+      ina260[ina].setAlertLatch(INA260_ALERT_LATCH_TRANSPARENT);
+
+      // Default the over current alert at 2000mA (2A)
+      ina260[ina].setAlertType(INA260_ALERT_OVERCURRENT);
+      ina260[ina].setAlertLimit(DEFAULT_OVERCURRENT_MA);
+    }
+    else
+    {
+      oxrs.println(F("empty"));
+    }
+  }
+}
+
 /**
   Setup
 */
 void setup()
 {
-  // Start serial and let settle
+  // Start serial (no need to wait, the I2C scan gives it time to settle)
   Serial.begin(SERIAL_BAUD_RATE);
-  delay(1000);
   Serial.println(F("[pdu ] starting up..."));
 
-  // Start the I2C bus
+  // Start the I2C bus (shared by the sensor task and loop) at full speed
   Wire.begin();
-
-  // Scan the I2C bus and set up current sensors and I/O buffers
-  scanI2CBus();
+  Wire.setClock(I2C_CLOCK_SPEED);
+  Wire.setTimeOut(I2C_TIMEOUT_MS);
+  g_i2cMutex = xSemaphoreCreateRecursiveMutex();
+
+  // Restore the relay states and energy counters from NVS
+  nvs.begin("pdu");
+  restoreRelayState();
+  restoreEnergy();
+  esp_register_shutdown_handler(checkpointEnergyOnShutdown);
+
+  // Drive the relays to their intended state first
+  scanMcps();
+  g_bootRelays_ms = millis();
+
+  // Set up the current sensors before anything else, so every output has
+  // its limits programmed before the sensor task starts (only a few ms of
+  // I2C, see the boot timings in the diagnostics, so not worth overlapping
+  // with the network bring-up)
+  scanInas();
+  g_bootSensors_ms = millis();
+
+  // Start sampling the INA260s on their own core, so outputs are protected
+  // while the network comes up (transactions from the Rack32 library are 
+  // serialised by the Wire driver, ours are grouped by the I2C lock)
+  xTaskCreatePinnedToCore(sensorTask, "sensors", SENSOR_TASK_STACK_SIZE, NULL, SENSOR_TASK_PRIORITY, &g_sensorTask, SENSOR_TASK_CORE);
+
+#if defined(INA_ALERT_PIN)
+  // Trip over-current outputs as soon as any INA260 raises its alert
+  pinMode(INA_ALERT_PIN, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(INA_ALERT_PIN), inaAlertIsr, FALLING);
+#endif
 
   // Scan for and initialise any fan controllers found on the I2C bus
+  lockI2C();
   fan.begin();
+  unlockI2C();
 
   // Start Rack32 hardware
   oxrs.begin(jsonConfig, jsonCommand);
+  g_bootNetwork_ms = millis();
 
   // Set up config/command schema (for self-discovery and adoption)
   setConfigSchema();
   setCommandSchema();
-  
-  // Speed up I2C clock for faster scan rate (after bus scan)
+
+  // Serve the diagnostic counters over REST as well as MQTT
+  oxrs.getAPI()->get("/diagnostics", &apiGetDiagnostics);
+
+  // The Rack32 library may have re-initialised the I2C bus (the sensor task
+  // is already running, so wait for any transaction in progress)
+  lockI2C();
   Wire.setClock(I2C_CLOCK_SPEED);
+  unlockI2C();
 }
 
 /**
@@ -932,21 +2860,33 @@ void setup()
 */
 void loop()
 {
+  // Each stage is timed for the diagnostics latency histograms
+  uint32_t startCycles = ESP.getCycleCount();
+
   // Let Rack32 hardware handle any events etc
   oxrs.loop();
+  startCycles = recordStage(STAGE_OXRS_LOOP, startCycles);
 
-  // Process INA260 sensors
+  // Process INA260 samples handed over by the sensor task
   processInas();
+  startCycles = recordStage(STAGE_PROCESS_INAS, startCycles);
 
   // Process MCPs
   processMcps();
+  startCycles = recordStage(STAGE_PROCESS_MCPS, startCycles);
 
   // Process fans
   processFans();
+  startCycles = recordStage(STAGE_PROCESS_FANS, startCycles);
 
   // Check if we need to publish any Home Assistant discovery payloads
   if (hass.isDiscoveryEnabled())
   {
     publishHassDiscovery();
+    startCycles = recordStage(STAGE_HASS_DISCOVERY, startCycles);
   }
+
+  // Publish any queued status events and telemetry
+  processPublishQueue();
+  recordStage(STAGE_PUBLISH_QUEUE, startCycles);
 }
\ No newline at end of file
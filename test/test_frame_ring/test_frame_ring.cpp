@@ -0,0 +1,177 @@
+#include <unity.h>
+#include <stdio.h>
+#include <thread>
+#include <PDU_FrameRing.h>
+
+// Frames pushed by the concurrent test, large enough that a torn copy would
+// show up as readings from two different frames
+#define       CONCURRENT_FRAMES       200000
+#define       CONCURRENT_READINGS     32
+
+typedef struct
+{
+  uint32_t timestamp;
+  int32_t mA[4];
+} frame_t;
+
+FrameRing<frame_t, 4> ring;
+
+typedef struct
+{
+  uint32_t timestamp;
+  int32_t mA[CONCURRENT_READINGS];
+} largeFrame_t;
+
+FrameRing<largeFrame_t, 16> largeRing;
+
+void setUp(void)
+{
+  while (ring.peek() != nullptr)
+  {
+    ring.pop();
+  }
+}
+
+void tearDown(void)
+{
+}
+
+void test_empty_ring_has_no_frames(void)
+{
+  TEST_ASSERT_NULL(ring.peek());
+  TEST_ASSERT_EQUAL_UINT32(0, ring.count());
+}
+
+void test_frames_come_out_in_order(void)
+{
+  frame_t frame = {};
+
+  for (uint32_t i = 1; i <= 3; i++)
+  {
+    frame.timestamp = i;
+    TEST_ASSERT_TRUE(ring.push(frame));
+  }
+  TEST_ASSERT_EQUAL_UINT32(3, ring.count());
+
+  for (uint32_t i = 1; i <= 3; i++)
+  {
+    frame_t * next = ring.peek();
+    TEST_ASSERT_NOT_NULL(next);
+    TEST_ASSERT_EQUAL_UINT32(i, next->timestamp);
+    ring.pop();
+  }
+  TEST_ASSERT_NULL(ring.peek());
+}
+
+void test_full_ring_drops_new_frames(void)
+{
+  frame_t frame = {};
+
+  for (uint32_t i = 1; i <= 4; i++)
+  {
+    frame.timestamp = i;
+    TEST_ASSERT_TRUE(ring.push(frame));
+  }
+
+  frame.timestamp = 5;
+  TEST_ASSERT_FALSE(ring.push(frame));
+  TEST_ASSERT_EQUAL_UINT32(4, ring.count());
+  TEST_ASSERT_EQUAL_UINT32(1, ring.peek()->timestamp);
+}
+
+void test_ring_wraps_around(void)
+{
+  frame_t frame = {};
+
+  for (uint32_t i = 1; i <= 10; i++)
+  {
+    frame.timestamp = i;
+    TEST_ASSERT_TRUE(ring.push(frame));
+    TEST_ASSERT_EQUAL_UINT32(i, ring.peek()->timestamp);
+    ring.pop();
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, ring.count());
+}
+
+void test_concurrent_producer_and_consumer(void)
+{
+  uint32_t failed = 0;
+  std::atomic<bool> done(false);
+
+  // Producer (the sensor task) numbers every frame and fills it from that
+  std::thread producer([&failed, &done]() {
+    largeFrame_t frame;
+    for (uint32_t i = 1; i <= CONCURRENT_FRAMES; i++)
+    {
+      frame.timestamp = i;
+      for (uint8_t n = 0; n < CONCURRENT_READINGS; n++)
+      {
+        frame.mA[n] = (int32_t)(i * CONCURRENT_READINGS + n);
+      }
+
+      // Give the consumer a chance to catch up after a drop, as the sensor
+      // task would by waiting for its next scan
+      if (!largeRing.push(frame))
+      {
+        failed++;
+        std::this_thread::yield();
+      }
+    }
+    done.store(true);
+  });
+
+  // Consumer (loop) drains until the producer has finished and the ring is empty
+  uint32_t received = 0;
+  uint32_t reordered = 0;
+  uint32_t torn = 0;
+  uint32_t last = 0;
+  while (true)
+  {
+    bool finished = done.load();
+
+    largeFrame_t * frame = largeRing.peek();
+    if (frame == nullptr)
+    {
+      if (finished)
+        break;
+
+      std::this_thread::yield();
+      continue;
+    }
+
+    if (frame->timestamp <= last) { reordered++; }
+    last = frame->timestamp;
+
+    for (uint8_t n = 0; n < CONCURRENT_READINGS; n++)
+    {
+      if (frame->mA[n] != (int32_t)(frame->timestamp * CONCURRENT_READINGS + n))
+      {
+        torn++;
+        break;
+      }
+    }
+
+    largeRing.pop();
+    received++;
+  }
+
+  producer.join();
+  printf("concurrent: %u received, %u dropped\n", (unsigned)received, (unsigned)failed);
+
+  TEST_ASSERT_EQUAL_UINT32(0, reordered);
+  TEST_ASSERT_EQUAL_UINT32(0, torn);
+  TEST_ASSERT_EQUAL_UINT32(CONCURRENT_FRAMES, received + failed);
+  TEST_ASSERT_TRUE(received > 0);
+  TEST_ASSERT_EQUAL_UINT32(0, largeRing.count());
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_ring_has_no_frames);
+  RUN_TEST(test_frames_come_out_in_order);
+  RUN_TEST(test_full_ring_drops_new_frames);
+  RUN_TEST(test_ring_wraps_around);
+  RUN_TEST(test_concurrent_producer_and_consumer);
+  return UNITY_END();
+}
@@ -0,0 +1,226 @@
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <PDU_JsonArena.h>
+
+// Builds and clears telemetry, status event and discovery sized documents
+// over and over, the way loop() reuses its arenas, checking nothing ever
+// falls back to the heap and the arenas don't creep
+
+#define       OUTPUT_COUNT            16
+#define       BUILD_CYCLES            200
+
+// Same sizes as the firmware's arenas (JSON_ARENA_xxx_SIZE in main.cpp)
+#define       PDU_ARENA_SIZE          12288
+#define       SCRATCH_ARENA_SIZE      12288
+
+// Heap allocations made while counting
+bool countHeap = false;
+uint32_t heapAllocations = 0;
+
+void * operator new(size_t size)
+{
+  if (countHeap) { heapAllocations++; }
+
+  void * ptr = malloc(size ? size : 1);
+  if (ptr == nullptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void * ptr) noexcept { free(ptr); }
+void operator delete(void * ptr, size_t) noexcept { free(ptr); }
+
+// Passes everything through to an arena, counting what it couldn't serve
+class CountingAllocator : public ArduinoJson::Allocator
+{
+  public:
+    CountingAllocator(JsonArena * arena) : allocations(0), fallbacks(0), _arena(arena) {}
+
+    uint32_t allocations;
+    uint32_t fallbacks;
+
+    void * allocate(size_t size) override
+    {
+      allocations++;
+      void * ptr = _arena->allocate(size);
+      if (ptr == nullptr) { fallbacks++; }
+      return ptr;
+    }
+
+    void deallocate(void * ptr) override
+    {
+      _arena->deallocate(ptr);
+    }
+
+    void * reallocate(void * ptr, size_t size) override
+    {
+      allocations++;
+      void * moved = _arena->reallocate(ptr, size);
+      if (moved == nullptr) { fallbacks++; }
+      return moved;
+    }
+
+  private:
+    JsonArena * _arena;
+};
+
+StaticJsonArena<PDU_ARENA_SIZE> pduArena;
+StaticJsonArena<SCRATCH_ARENA_SIZE> scratchArena;
+
+// Copied (rather than literal) strings, as the firmware builds its topics
+// and templates in buffers
+char text[128];
+
+char * copy(const char * format, uint8_t output)
+{
+  snprintf(text, sizeof(text), format, output);
+  return text;
+}
+
+void buildTelemetry(JsonDocument & json)
+{
+  JsonArray array = json.to<JsonArray>();
+
+  for (uint8_t output = 0; output < OUTPUT_COUNT; output++)
+  {
+    JsonObject object = array.add<JsonObject>();
+    object["index"] = output + 1;
+    object["mA"] = 1200 + output;
+    object["mV"] = 12010 + output;
+    object["mW"] = 14400 + output;
+    object["mWh"] = 100000 + output;
+    object["mAMin"] = 1100;
+    object["mAMax"] = 1300;
+    object["mAAvg"] = 1200;
+    object["mARms"] = 1210;
+    object["mVMin"] = 11990;
+    object["mVMax"] = 12030;
+    object["mVAvg"] = 12010;
+    object["mWMax"] = 15600;
+    object["mWAvg"] = 14400;
+    object["samples"] = 1500;
+  }
+}
+
+void buildStatusEvent(JsonDocument & json)
+{
+  json["index"] = 7;
+  json["type"] = copy("relay", 0);
+  json["event"] = copy("on", 0);
+}
+
+void buildDiscovery(JsonDocument & json)
+{
+  json["uniq_id"] = copy("pdu_123456_mA_sensor_%d", 7);
+  json["obj_id"] = copy("pdu_123456_mA_sensor_%d", 7);
+  json["avty_t"] = copy("stat/pdu-123456/lwt", 0);
+  json["pl_avail"] = "online";
+  json["pl_not_avail"] = "offline";
+
+  JsonObject device = json["dev"].to<JsonObject>();
+  device["ids"].add(copy("pdu_123456", 0));
+  device["name"] = copy("OXRS BMD PDU", 0);
+  device["mf"] = copy("Big Mission Design", 0);
+  device["mdl"] = copy("OXRS-BMD-PDU-ESP32-FW", 0);
+  device["sw"] = copy("1.2.3", 0);
+
+  json["name"] = copy("mA Sensor %d", 7);
+  json["dev_cla"] = "current";
+  json["unit_of_meas"] = "mA";
+  json["stat_t"] = copy("tele/pdu-123456", 0);
+  json["val_tpl"] = copy("{% set o = value_json | selectattr('index', 'equalto', %d) | list %}{{ o[0].mA if o else this.state }}", 7);
+}
+
+// Build and clear the same document repeatedly, the first build sets the
+// high-water mark every later one has to match
+void cycle(JsonArena * arena, void (*build)(JsonDocument &), const char * name)
+{
+  CountingAllocator allocator(arena);
+  JsonDocument json(&allocator);
+
+  size_t firstUsed = 0;
+  uint32_t grown = 0;
+  uint32_t notReset = 0;
+
+  countHeap = true;
+  heapAllocations = 0;
+
+  for (uint16_t i = 0; i < BUILD_CYCLES; i++)
+  {
+    json.clear();
+    arena->reset();
+    if (arena->used() != 0) { notReset++; }
+
+    build(json);
+
+    if (i == 0) { firstUsed = arena->used(); }
+    if (arena->used() != firstUsed) { grown++; }
+  }
+
+  countHeap = false;
+
+  printf("%-10s %5zu bytes used, %5zu peak of %5zu, %u allocations\n",
+    name, firstUsed, arena->peak(), arena->size(), (unsigned)(allocator.allocations / BUILD_CYCLES));
+
+  TEST_ASSERT_TRUE(firstUsed > 0);
+  TEST_ASSERT_EQUAL_UINT32(0, grown);
+  TEST_ASSERT_EQUAL_UINT32(0, notReset);
+  TEST_ASSERT_EQUAL_UINT32(0, allocator.fallbacks);
+  TEST_ASSERT_EQUAL_UINT32(0, arena->overflows());
+  TEST_ASSERT_EQUAL_UINT32(0, heapAllocations);
+  TEST_ASSERT_FALSE(json.overflowed());
+}
+
+void setUp(void)
+{
+  pduArena.reset();
+  scratchArena.reset();
+}
+
+void tearDown(void)
+{
+}
+
+void test_telemetry_reuses_its_arena(void)
+{
+  cycle(&pduArena, buildTelemetry, "telemetry");
+}
+
+void test_status_event_reuses_scratch_arena(void)
+{
+  cycle(&scratchArena, buildStatusEvent, "status");
+}
+
+void test_discovery_reuses_scratch_arena(void)
+{
+  cycle(&scratchArena, buildDiscovery, "discovery");
+}
+
+void test_overflow_is_refused_not_allocated(void)
+{
+  StaticJsonArena<256> arena;
+  CountingAllocator allocator(&arena);
+  JsonDocument json(&allocator);
+
+  countHeap = true;
+  heapAllocations = 0;
+  buildTelemetry(json);
+  countHeap = false;
+
+  TEST_ASSERT_TRUE(json.overflowed());
+  TEST_ASSERT_TRUE(arena.overflows() > 0);
+  TEST_ASSERT_TRUE(arena.used() <= arena.size());
+  TEST_ASSERT_EQUAL_UINT32(0, heapAllocations);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_telemetry_reuses_its_arena);
+  RUN_TEST(test_status_event_reuses_scratch_arena);
+  RUN_TEST(test_discovery_reuses_scratch_arena);
+  RUN_TEST(test_overflow_is_refused_not_allocated);
+  return UNITY_END();
+}
@@ -0,0 +1,166 @@
+#include <unity.h>
+#include <string.h>
+#include <PDU_Protection.h>
+
+protection_t protection;
+
+void setUp(void)
+{
+  memset(&protection, 0, sizeof(protection));
+  protection.limit_mA = 1000;
+  protection.onTime = 1L;
+}
+
+void tearDown(void)
+{
+}
+
+// Time from the first sample over the limit until a trip, sampling every 10ms
+uint32_t timeToTrip(int32_t mA)
+{
+  for (uint32_t timestamp = 1000; timestamp < 61000; timestamp += 10)
+  {
+    if (isOverCurrent(&protection, timestamp, mA))
+      return timestamp - 1000;
+  }
+  return 0xFFFFFFFF;
+}
+
+void test_under_limit_never_trips(void)
+{
+  protection.tripDelay_ms = 100;
+
+  for (uint32_t timestamp = 1000; timestamp < 60000; timestamp += 10)
+  {
+    TEST_ASSERT_FALSE(isOverCurrent(&protection, timestamp, 1000));
+  }
+  TEST_ASSERT_EQUAL(0, protection.overload);
+}
+
+void test_no_trip_delay_trips_immediately(void)
+{
+  TEST_ASSERT_FALSE(isOverCurrent(&protection, 1000, 1000));
+  TEST_ASSERT_TRUE(isOverCurrent(&protection, 1010, 1001));
+}
+
+void test_instant_limit_trips_immediately(void)
+{
+  protection.tripDelay_ms = 100;
+  protection.instantLimit_mA = 5000;
+
+  TEST_ASSERT_FALSE(isOverCurrent(&protection, 1000, 4000));
+  TEST_ASSERT_TRUE(isOverCurrent(&protection, 1010, 5001));
+}
+
+void test_trip_delay_at_twice_the_limit(void)
+{
+  protection.tripDelay_ms = 100;
+
+  TEST_ASSERT_EQUAL_UINT32(100, timeToTrip(2000));
+}
+
+void test_smaller_overloads_take_longer(void)
+{
+  protection.tripDelay_ms = 100;
+
+  // (1.5^2 - 1) / (2^2 - 1) = 1 / 2.4
+  TEST_ASSERT_EQUAL_UINT32(240, timeToTrip(1500));
+}
+
+void test_larger_overloads_trip_sooner(void)
+{
+  protection.tripDelay_ms = 100;
+
+  // (3^2 - 1) / (2^2 - 1) = 8 / 3, rounded up to the next sample
+  TEST_ASSERT_EQUAL_UINT32(40, timeToTrip(3000));
+}
+
+void test_overload_drains_under_the_limit(void)
+{
+  protection.tripDelay_ms = 100;
+
+  uint32_t timestamp = 1000;
+  for (; timestamp <= 1050; timestamp += 10)
+  {
+    TEST_ASSERT_FALSE(isOverCurrent(&protection, timestamp, 2000));
+  }
+  for (; timestamp <= 1200; timestamp += 10)
+  {
+    TEST_ASSERT_FALSE(isOverCurrent(&protection, timestamp, 0));
+  }
+  TEST_ASSERT_EQUAL(0, protection.overload);
+}
+
+void test_default_instant_limit_with_trip_delay(void)
+{
+  protection.tripDelay_ms = 100;
+
+  TEST_ASSERT_EQUAL_UINT16(4000, getInstantLimit(&protection));
+  TEST_ASSERT_FALSE(isOverCurrent(&protection, 1000, 4000));
+  TEST_ASSERT_TRUE(isOverCurrent(&protection, 1010, 4001));
+
+  protection.limit_mA = 5000;
+  TEST_ASSERT_EQUAL_UINT16(15000, getInstantLimit(&protection));
+}
+
+void test_inrush_allowed_after_switching_on(void)
+{
+  protection.inrush_mA = 3000;
+  protection.inrushTime_ms = 200;
+  protection.onTime = 1000;
+
+  TEST_ASSERT_FALSE(isOverCurrent(&protection, 1010, 2500));
+  TEST_ASSERT_FALSE(isOverCurrent(&protection, 1190, 2500));
+  TEST_ASSERT_TRUE(isOverCurrent(&protection, 1210, 2500));
+}
+
+void test_alert_limit_is_highest_allowed_current(void)
+{
+  TEST_ASSERT_EQUAL_UINT16(1000, getAlertLimit(&protection));
+
+  protection.tripDelay_ms = 100;
+  TEST_ASSERT_EQUAL_UINT16(4000, getAlertLimit(&protection));
+
+  protection.tripDelay_ms = 0;
+
+  protection.inrush_mA = 3000;
+  TEST_ASSERT_EQUAL_UINT16(3000, getAlertLimit(&protection));
+
+  protection.instantLimit_mA = 5000;
+  TEST_ASSERT_EQUAL_UINT16(5000, getAlertLimit(&protection));
+}
+
+void test_retry_backs_off_exponentially(void)
+{
+  protection.retryCount = 3;
+  protection.retryDelay_s = 5;
+
+  TEST_ASSERT_TRUE(scheduleRetry(&protection, 1000));
+  TEST_ASSERT_EQUAL_UINT32(6000, protection.retryTime);
+
+  protection.retries = 2;
+  TEST_ASSERT_TRUE(scheduleRetry(&protection, 1000));
+  TEST_ASSERT_EQUAL_UINT32(21000, protection.retryTime);
+
+  protection.retryTime = 0L;
+  protection.retries = 3;
+  TEST_ASSERT_FALSE(scheduleRetry(&protection, 1000));
+  TEST_ASSERT_EQUAL_UINT32(0, protection.retryTime);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_under_limit_never_trips);
+  RUN_TEST(test_no_trip_delay_trips_immediately);
+  RUN_TEST(test_instant_limit_trips_immediately);
+  RUN_TEST(test_trip_delay_at_twice_the_limit);
+  RUN_TEST(test_smaller_overloads_take_longer);
+  RUN_TEST(test_larger_overloads_trip_sooner);
+  RUN_TEST(test_overload_drains_under_the_limit);
+  RUN_TEST(test_default_instant_limit_with_trip_delay);
+  RUN_TEST(test_inrush_allowed_after_switching_on);
+  RUN_TEST(test_alert_limit_is_highest_allowed_current);
+  RUN_TEST(test_retry_backs_off_exponentially);
+  return UNITY_END();
+}
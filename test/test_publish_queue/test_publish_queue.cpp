@@ -0,0 +1,314 @@
+#include <unity.h>
+#include <PDU_PublishQueue.h>
+
+#define RELAY 1
+
+#define PUBLISH_BURST 2
+#define RETRY_MS      1000
+
+StatusEventQueue<4> * queue;
+PublishBackoff * backoff;
+
+// Fake broker, accepting publishes while up (or for a few more publishes)
+bool brokerUp;
+int8_t publishesLeft;
+uint32_t attempts;
+statusEvent_t published[8];
+uint8_t publishedCount;
+uint32_t recovered;
+
+bool fakePublish(statusEvent_t * statusEvent)
+{
+  attempts++;
+  if (!brokerUp && publishesLeft-- <= 0)
+    return false;
+
+  published[publishedCount++] = *statusEvent;
+  return true;
+}
+
+// The same steps as processPublishQueue() in the firmware
+void publishLoop(uint32_t now)
+{
+  if (backoff->isWaiting(now))
+    return;
+
+  if (!queue->drain(PUBLISH_BURST, fakePublish))
+  {
+    backoff->fail(now);
+    return;
+  }
+
+  if (backoff->takeRecovered(queue->count() == 0))
+  {
+    recovered++;
+  }
+}
+
+void setUp(void)
+{
+  queue = new StatusEventQueue<4>();
+  backoff = new PublishBackoff(RETRY_MS);
+
+  brokerUp = true;
+  publishesLeft = 0;
+  attempts = 0;
+  publishedCount = 0;
+  recovered = 0;
+}
+
+void tearDown(void)
+{
+  delete queue;
+  delete backoff;
+}
+
+void test_events_come_out_in_order(void)
+{
+  queue->push(0, RELAY, 1);
+  queue->push(1, ALERT_EVENT, 2);
+  queue->push(2, RELAY, 0);
+
+  TEST_ASSERT_EQUAL_UINT8(3, queue->count());
+  TEST_ASSERT_EQUAL_UINT8(0, queue->get(0)->index);
+  TEST_ASSERT_EQUAL_UINT8(ALERT_EVENT, queue->get(1)->type);
+  TEST_ASSERT_EQUAL_UINT8(2, queue->get(2)->index);
+
+  queue->remove(0);
+  TEST_ASSERT_EQUAL_UINT8(2, queue->count());
+  TEST_ASSERT_EQUAL_UINT8(1, queue->get(0)->index);
+}
+
+void test_remove_keeps_remaining_order(void)
+{
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    queue->push(i, RELAY, 1);
+  }
+
+  queue->remove(2);
+  TEST_ASSERT_EQUAL_UINT8(3, queue->count());
+  TEST_ASSERT_EQUAL_UINT8(0, queue->get(0)->index);
+  TEST_ASSERT_EQUAL_UINT8(1, queue->get(1)->index);
+  TEST_ASSERT_EQUAL_UINT8(3, queue->get(2)->index);
+}
+
+void test_alerts_are_never_dropped(void)
+{
+  queue->push(0, ALERT_EVENT, 1);
+  queue->push(1, RELAY, 1);
+  queue->push(2, ALERT_EVENT, 1);
+  queue->push(3, ALERT_EVENT, 1);
+  queue->push(4, ALERT_EVENT, 1);
+
+  TEST_ASSERT_EQUAL_UINT8(4, queue->count());
+  TEST_ASSERT_EQUAL_UINT32(1, queue->dropped());
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    TEST_ASSERT_EQUAL_UINT8(ALERT_EVENT, queue->get(i)->type);
+  }
+}
+
+void test_repeated_alerts_are_merged(void)
+{
+  queue->push(0, ALERT_EVENT, 1);
+  queue->push(1, ALERT_EVENT, 1);
+  queue->push(2, ALERT_EVENT, 1);
+  queue->push(0, ALERT_EVENT, 1);
+  queue->push(3, ALERT_EVENT, 1);
+
+  TEST_ASSERT_EQUAL_UINT8(4, queue->count());
+  TEST_ASSERT_EQUAL_UINT32(1, queue->coalesced());
+  TEST_ASSERT_EQUAL_UINT32(0, queue->dropped());
+  TEST_ASSERT_EQUAL_UINT8(1, queue->get(0)->index);
+  TEST_ASSERT_EQUAL_UINT8(0, queue->get(2)->index);
+  TEST_ASSERT_EQUAL_UINT8(3, queue->get(3)->index);
+  TEST_ASSERT_EQUAL_UINT8(4, queue->maxCount());
+}
+
+void test_different_alerts_are_never_merged(void)
+{
+  queue->push(0, ALERT_EVENT, 1);
+  queue->push(0, ALERT_EVENT, 2);
+  queue->push(1, ALERT_EVENT, 1);
+  queue->push(0, ALERT_EVENT, 1);
+  queue->push(2, ALERT_EVENT, 1);
+
+  // Only the repeat of the first alert goes, the newer different one stays
+  TEST_ASSERT_EQUAL_UINT8(4, queue->count());
+  TEST_ASSERT_EQUAL_UINT32(1, queue->coalesced());
+  TEST_ASSERT_EQUAL_UINT8(0, queue->get(0)->index);
+  TEST_ASSERT_EQUAL_UINT8(2, queue->get(0)->event);
+  TEST_ASSERT_EQUAL_UINT8(0, queue->get(2)->index);
+  TEST_ASSERT_EQUAL_UINT8(1, queue->get(2)->event);
+}
+
+void test_relay_events_go_before_alerts_merge(void)
+{
+  queue->push(0, ALERT_EVENT, 1);
+  queue->push(1, RELAY, 1);
+  queue->push(0, ALERT_EVENT, 1);
+  queue->push(2, RELAY, 1);
+  queue->push(3, ALERT_EVENT, 2);
+
+  TEST_ASSERT_EQUAL_UINT32(0, queue->coalesced());
+  TEST_ASSERT_EQUAL_UINT32(1, queue->dropped());
+  TEST_ASSERT_TRUE(queue->takeResync());
+  TEST_ASSERT_EQUAL_UINT8(ALERT_EVENT, queue->get(0)->type);
+  TEST_ASSERT_EQUAL_UINT8(ALERT_EVENT, queue->get(1)->type);
+  TEST_ASSERT_EQUAL_UINT8(2, queue->get(2)->index);
+  TEST_ASSERT_EQUAL_UINT8(3, queue->get(3)->index);
+}
+
+void test_superseded_relay_events_are_coalesced(void)
+{
+  queue->push(0, RELAY, 1);
+  queue->push(1, RELAY, 1);
+  queue->push(0, RELAY, 0);
+  queue->push(2, RELAY, 1);
+  queue->push(3, RELAY, 1);
+
+  TEST_ASSERT_EQUAL_UINT8(4, queue->count());
+  TEST_ASSERT_EQUAL_UINT32(1, queue->coalesced());
+  TEST_ASSERT_EQUAL_UINT32(0, queue->dropped());
+  TEST_ASSERT_FALSE(queue->takeResync());
+  TEST_ASSERT_EQUAL_UINT8(1, queue->get(0)->index);
+  TEST_ASSERT_EQUAL_UINT8(0, queue->get(1)->index);
+  TEST_ASSERT_EQUAL_UINT8(0, queue->get(1)->event);
+}
+
+void test_relay_event_never_superseded_by_alert(void)
+{
+  queue->push(0, RELAY, 0);
+  queue->push(0, ALERT_EVENT, 1);
+  queue->push(1, RELAY, 1);
+  queue->push(2, RELAY, 1);
+  queue->push(3, RELAY, 1);
+
+  TEST_ASSERT_EQUAL_UINT32(0, queue->coalesced());
+  TEST_ASSERT_EQUAL_UINT32(1, queue->dropped());
+  TEST_ASSERT_EQUAL_UINT8(ALERT_EVENT, queue->get(0)->type);
+}
+
+void test_dropped_relay_event_flags_resync(void)
+{
+  for (uint8_t i = 0; i < 5; i++)
+  {
+    queue->push(i, RELAY, 1);
+  }
+
+  TEST_ASSERT_EQUAL_UINT8(4, queue->count());
+  TEST_ASSERT_EQUAL_UINT32(1, queue->dropped());
+  TEST_ASSERT_EQUAL_UINT8(1, queue->get(0)->index);
+
+  // Only reported once
+  TEST_ASSERT_TRUE(queue->takeResync());
+  TEST_ASSERT_FALSE(queue->takeResync());
+}
+
+void test_drain_publishes_a_burst_in_order(void)
+{
+  queue->push(0, RELAY, 1);
+  queue->push(1, ALERT_EVENT, 2);
+  queue->push(2, RELAY, 0);
+
+  TEST_ASSERT_TRUE(queue->drain(PUBLISH_BURST, fakePublish));
+  TEST_ASSERT_EQUAL_UINT8(2, publishedCount);
+  TEST_ASSERT_EQUAL_UINT8(0, published[0].index);
+  TEST_ASSERT_EQUAL_UINT8(1, published[1].index);
+  TEST_ASSERT_EQUAL_UINT8(1, queue->count());
+  TEST_ASSERT_EQUAL_UINT8(2, queue->get(0)->index);
+}
+
+void test_failed_publish_backs_off_and_replays(void)
+{
+  queue->push(0, RELAY, 1);
+  queue->push(1, ALERT_EVENT, 2);
+  queue->push(2, RELAY, 0);
+
+  // Broker down, everything stays queued
+  brokerUp = false;
+  publishLoop(0);
+  TEST_ASSERT_EQUAL_UINT32(1, attempts);
+  TEST_ASSERT_EQUAL_UINT32(1, backoff->failures());
+  TEST_ASSERT_EQUAL_UINT8(3, queue->count());
+
+  // Nothing is attempted until the retry is due
+  brokerUp = true;
+  publishLoop(500);
+  publishLoop(RETRY_MS - 1);
+  TEST_ASSERT_EQUAL_UINT32(1, attempts);
+  TEST_ASSERT_EQUAL_UINT8(0, publishedCount);
+
+  // Then replayed in order, a burst at a time, recovering once drained
+  publishLoop(RETRY_MS);
+  TEST_ASSERT_EQUAL_UINT8(2, publishedCount);
+  TEST_ASSERT_EQUAL_UINT32(0, recovered);
+  TEST_ASSERT_TRUE(backoff->isFailed());
+
+  publishLoop(RETRY_MS + 10);
+  TEST_ASSERT_EQUAL_UINT8(3, publishedCount);
+  TEST_ASSERT_EQUAL_UINT32(1, recovered);
+  TEST_ASSERT_FALSE(backoff->isFailed());
+
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    TEST_ASSERT_EQUAL_UINT8(i, published[i].index);
+  }
+
+  publishLoop(RETRY_MS + 20);
+  TEST_ASSERT_EQUAL_UINT32(1, recovered);
+}
+
+void test_failure_mid_burst_loses_nothing(void)
+{
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    queue->push(i, RELAY, 1);
+  }
+
+  // Broker goes away after the first publish
+  brokerUp = false;
+  publishesLeft = 1;
+  publishLoop(0);
+  TEST_ASSERT_EQUAL_UINT8(1, publishedCount);
+  TEST_ASSERT_EQUAL_UINT8(3, queue->count());
+  TEST_ASSERT_EQUAL_UINT8(1, queue->get(0)->index);
+
+  // Still down at the first retry, backs off again
+  publishLoop(RETRY_MS);
+  TEST_ASSERT_EQUAL_UINT32(2, backoff->failures());
+  TEST_ASSERT_EQUAL_UINT8(1, publishedCount);
+
+  // Back, and each event is published exactly once, in order
+  brokerUp = true;
+  for (uint32_t now = 2 * RETRY_MS; queue->count() > 0; now += 10)
+  {
+    publishLoop(now);
+  }
+
+  TEST_ASSERT_EQUAL_UINT8(4, publishedCount);
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    TEST_ASSERT_EQUAL_UINT8(i, published[i].index);
+  }
+  TEST_ASSERT_EQUAL_UINT32(1, recovered);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_events_come_out_in_order);
+  RUN_TEST(test_remove_keeps_remaining_order);
+  RUN_TEST(test_alerts_are_never_dropped);
+  RUN_TEST(test_repeated_alerts_are_merged);
+  RUN_TEST(test_different_alerts_are_never_merged);
+  RUN_TEST(test_relay_events_go_before_alerts_merge);
+  RUN_TEST(test_superseded_relay_events_are_coalesced);
+  RUN_TEST(test_relay_event_never_superseded_by_alert);
+  RUN_TEST(test_dropped_relay_event_flags_resync);
+  RUN_TEST(test_drain_publishes_a_burst_in_order);
+  RUN_TEST(test_failed_publish_backs_off_and_replays);
+  RUN_TEST(test_failure_mid_burst_loses_nothing);
+  return UNITY_END();
+}
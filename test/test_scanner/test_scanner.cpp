@@ -0,0 +1,361 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <PDU_Scanner.h>
+
+// Drives whole sensor sweeps against a model of the INA260 registers and the
+// relay shadow, counting the bus transactions each sweep costs
+
+#define       OUTPUT_COUNT            16
+#define       SWEEP_MS                10
+
+class FakeBus : public PduBus
+{
+  public:
+    uint16_t current[OUTPUT_COUNT];
+    uint16_t voltage[OUTPUT_COUNT];
+    bool on[OUTPUT_COUNT];
+    bool dirty;
+
+    uint32_t reads;
+    uint32_t writes;
+
+    void setmA(uint8_t ina, int32_t mA)
+    {
+      current[ina] = (uint16_t)(int16_t)((mA * 1000L) / INA260_CURRENT_LSB_UA);
+    }
+
+    bool readRegister(uint8_t ina, uint8_t reg, uint16_t * value) override
+    {
+      reads++;
+
+      // Outputs which are off draw nothing
+      if (reg == INA_REG_CURRENT)    { *value = on[ina] ? current[ina] : 0; return true; }
+      if (reg == INA_REG_BUSVOLTAGE) { *value = voltage[ina]; return true; }
+      return false;
+    }
+
+    bool isOutputOn(uint8_t output) override
+    {
+      return on[output];
+    }
+
+    void setOutput(uint8_t output, bool state) override
+    {
+      if (on[output] == state)
+        return;
+
+      on[output] = state;
+      dirty = true;
+    }
+
+    // One transaction for the whole relay shadow, only when it has changed
+    void writeOutputs() override
+    {
+      if (!dirty)
+        return;
+
+      writes++;
+      dirty = false;
+    }
+};
+
+FakeBus bus;
+PduScanner<OUTPUT_COUNT> * scanner;
+PduFrame<OUTPUT_COUNT> frame;
+uint32_t now;
+
+void setUp(void)
+{
+  for (uint8_t ina = 0; ina < OUTPUT_COUNT; ina++)
+  {
+    bus.current[ina] = 0;
+    bus.voltage[ina] = (uint16_t)((12000L * 1000L) / INA260_VOLTAGE_LSB_UV);
+    bus.on[ina] = false;
+  }
+  bus.dirty = false;
+  bus.reads = 0;
+  bus.writes = 0;
+
+  scanner = new PduScanner<OUTPUT_COUNT>(&bus);
+  for (uint8_t ina = 0; ina < OUTPUT_COUNT; ina++)
+  {
+    scanner->inasFound |= (1 << ina);
+    scanner->inaList[scanner->inaListCount++] = ina;
+
+    memset(&scanner->protection[ina], 0, sizeof(protection_t));
+    scanner->protection[ina].limit_mA = 2000;
+    scanner->protection[ina].retryDelay_s = 5;
+
+    memset(&scanner->powerOn[ina], 0, sizeof(powerOn_t));
+    scanner->lastAlertType[ina] = ALERT_TYPE_NONE;
+    scanner->scanHotUntil[ina] = 0L;
+  }
+
+  memset(&frame, 0, sizeof(frame));
+  now = 10000L;
+}
+
+void tearDown(void)
+{
+  delete scanner;
+}
+
+// A single sweep, frame reset the same way as the sensor task does
+void sweep(void)
+{
+  frame.timestamp = now;
+  frame.sampled = 0;
+  frame.newAlerts = 0;
+  frame.tripped = 0;
+  frame.restored = 0;
+
+  scanner->sweep(&frame);
+  now += SWEEP_MS;
+}
+
+void switchOn(uint8_t ina, int32_t mA)
+{
+  bus.on[ina] = true;
+  bus.setmA(ina, mA);
+  scanner->protection[ina].onTime = now;
+}
+
+void test_full_sweep_reads_every_output(void)
+{
+  for (uint8_t ina = 0; ina < OUTPUT_COUNT; ina++)
+  {
+    switchOn(ina, 500);
+  }
+  now += 5000L;
+
+  sweep();
+  printf("full sweep: %u reads, %u relay writes\n", (unsigned)bus.reads, (unsigned)bus.writes);
+
+  // Current and bus voltage for each, and nothing to write to the relays
+  TEST_ASSERT_EQUAL_UINT32(2 * OUTPUT_COUNT, bus.reads);
+  TEST_ASSERT_EQUAL_UINT32(0, bus.writes);
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF, frame.sampled);
+  TEST_ASSERT_EQUAL_INT32(500, frame.mA[7]);
+  TEST_ASSERT_EQUAL_UINT32(12000, frame.mV[7]);
+  TEST_ASSERT_EQUAL_UINT32(6000, frame.mW[7]);
+}
+
+void test_idle_outputs_scanned_every_few_sweeps(void)
+{
+  for (uint8_t ina = 0; ina < OUTPUT_COUNT; ina++)
+  {
+    switchOn(ina, 200);
+  }
+  now += 5000L;
+  sweep();
+
+  // Wait for every output to settle after its first reading, then switch
+  // output 5 back on so it is read every sweep through its inrush window
+  now += SCAN_HOT_HOLD_MS;
+  scanner->inaIdleScanInterval = 4;
+  bus.on[5] = false;
+  switchOn(5, 1500);
+
+  uint32_t reads[4];
+  uint16_t sampled = 0;
+  uint8_t output5 = 0;
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    bus.reads = 0;
+    sweep();
+    reads[i] = bus.reads;
+    sampled |= frame.sampled;
+    if (frame.sampled & (1 << 5)) { output5++; }
+  }
+  printf("idle interval 4: %u/%u/%u/%u reads per sweep\n", (unsigned)reads[0], (unsigned)reads[1], (unsigned)reads[2], (unsigned)reads[3]);
+
+  // Every output once over 4 sweeps, the hot one every sweep
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF, sampled);
+  TEST_ASSERT_EQUAL_UINT8(4, output5);
+  TEST_ASSERT_EQUAL_UINT32(2 * OUTPUT_COUNT + 2 * 3, reads[0] + reads[1] + reads[2] + reads[3]);
+}
+
+void test_trip_delay_at_twice_the_limit(void)
+{
+  scanner->protection[3].tripDelay_ms = 100;
+  switchOn(3, 500);
+  now += 5000L;
+  sweep();
+
+  // Twice the limit, tripping 100ms after the last reading under it (each
+  // reading is integrated over the time since the one before)
+  bus.setmA(3, 4000);
+  uint32_t start = frame.timestamp;
+  uint32_t tripped = 0L;
+  uint32_t writes = bus.writes;
+  for (uint8_t i = 0; i < 50 && bus.on[3]; i++)
+  {
+    sweep();
+    if (frame.tripped & (1 << 3)) { tripped = frame.timestamp; }
+  }
+
+  TEST_ASSERT_FALSE(bus.on[3]);
+  TEST_ASSERT_EQUAL_UINT32(100, tripped - start);
+  TEST_ASSERT_EQUAL_UINT8(ALERT_TYPE_I_OVER, frame.alertType[3]);
+  TEST_ASSERT_TRUE(frame.newAlerts & (1 << 3));
+  TEST_ASSERT_EQUAL_UINT32(1, bus.writes - writes);
+}
+
+void test_hard_short_trips_on_first_sweep(void)
+{
+  scanner->protection[3].tripDelay_ms = 100;
+  switchOn(3, 500);
+  now += 5000L;
+  sweep();
+
+  // Over the default instant limit (4x)
+  bus.setmA(3, 8100);
+  sweep();
+
+  TEST_ASSERT_FALSE(bus.on[3]);
+  TEST_ASSERT_TRUE(frame.tripped & (1 << 3));
+  TEST_ASSERT_EQUAL_UINT32(1, bus.writes);
+}
+
+void test_retry_recloses_after_delay(void)
+{
+  scanner->protection[3].retryCount = 1;
+  switchOn(3, 500);
+  now += 5000L;
+  sweep();
+
+  bus.setmA(3, 2500);
+  sweep();
+  TEST_ASSERT_FALSE(bus.on[3]);
+
+  bus.setmA(3, 0);
+  now += 4900L;
+  sweep();
+  TEST_ASSERT_FALSE(bus.on[3]);
+
+  now += 100L;
+  sweep();
+  TEST_ASSERT_TRUE(bus.on[3]);
+  TEST_ASSERT_TRUE(frame.restored & (1 << 3));
+  TEST_ASSERT_EQUAL_UINT8(1, scanner->protection[3].retries);
+}
+
+void test_shed_includes_unsampled_outputs(void)
+{
+  for (uint8_t ina = 0; ina < 4; ina++)
+  {
+    scanner->protection[ina].limit_mA = 10000;
+    switchOn(ina, 1000);
+  }
+  now += 5000L;
+  sweep();
+  now += SCAN_HOT_HOLD_MS;
+
+  // Only outputs 0, 4, 8 and 12 are due this sweep, output 3 still counts
+  // towards the total with its last reading
+  scanner->inaIdleScanInterval = 4;
+  scanner->inaScanCount = 0;
+  bus.setmA(0, 6000);
+  frame.mA[3] = 3000;
+  sweep();
+
+  TEST_ASSERT_FALSE(frame.sampled & (1 << 3));
+  TEST_ASSERT_FALSE(bus.on[3]);
+  TEST_ASSERT_TRUE(bus.on[0]);
+  TEST_ASSERT_TRUE(bus.on[1]);
+  TEST_ASSERT_TRUE(bus.on[2]);
+  TEST_ASSERT_EQUAL_UINT8(ALERT_TYPE_I_OVER_TOTAL, frame.alertType[3]);
+  TEST_ASSERT_EQUAL_HEX16(1 << 3, scanner->shedOutputs);
+}
+
+void test_shed_lowest_priority_then_restore(void)
+{
+  scanner->loadShedRestore_ms = 100;
+  for (uint8_t ina = 0; ina < 4; ina++)
+  {
+    scanner->protection[ina].limit_mA = 10000;
+    scanner->protection[ina].priority = ina == 1 ? 0 : 1;
+    switchOn(ina, 3000);
+  }
+  now += 5000L;
+  sweep();
+
+  // 12A total, output 1 has the lowest priority
+  TEST_ASSERT_FALSE(bus.on[1]);
+  TEST_ASSERT_EQUAL_HEX16(1 << 1, scanner->shedOutputs);
+  TEST_ASSERT_EQUAL_INT32(3000, scanner->protection[1].shed_mA);
+
+  // Back with enough headroom, but only once it has lasted long enough
+  bus.setmA(0, 1000);
+  bus.setmA(2, 1000);
+  bus.setmA(3, 1000);
+  uint32_t start = now;
+  while (!bus.on[1] && now - start < 1000L)
+  {
+    sweep();
+  }
+
+  TEST_ASSERT_TRUE(bus.on[1]);
+  TEST_ASSERT_EQUAL_UINT32(100, frame.timestamp - start);
+  TEST_ASSERT_EQUAL_HEX16(0, scanner->shedOutputs);
+}
+
+void test_sequence_waits_for_settled_current(void)
+{
+  scanner->sequencePending = (1 << 0) | (1 << 1);
+  sweep();
+
+  // Lowest order and index first
+  TEST_ASSERT_TRUE(bus.on[0]);
+  TEST_ASSERT_FALSE(bus.on[1]);
+
+  // Still ramping, the next output waits
+  int32_t ramp[] = { 400, 800, 1000, 1020 };
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    bus.setmA(0, ramp[i]);
+    sweep();
+    TEST_ASSERT_FALSE(bus.on[1]);
+  }
+
+  // Two readings within the settle threshold
+  bus.setmA(0, ramp[3]);
+  sweep();
+  TEST_ASSERT_TRUE(bus.on[1]);
+  TEST_ASSERT_EQUAL_INT8(1, scanner->sequenceOutput);
+  TEST_ASSERT_EQUAL_HEX16(0, scanner->sequencePending);
+}
+
+void test_sequence_times_out_without_settling(void)
+{
+  scanner->sequencePending = (1 << 0) | (1 << 1);
+  sweep();
+  uint32_t start = frame.timestamp;
+
+  int32_t mA = 0;
+  while (!bus.on[1] && now - start < 5000L)
+  {
+    mA = mA == 0 ? 1000 : 0;
+    bus.setmA(0, mA);
+    sweep();
+  }
+
+  TEST_ASSERT_TRUE(bus.on[1]);
+  TEST_ASSERT_EQUAL_UINT32(SEQUENCE_SETTLE_TIMEOUT_MS, frame.timestamp - start);
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_full_sweep_reads_every_output);
+  RUN_TEST(test_idle_outputs_scanned_every_few_sweeps);
+  RUN_TEST(test_trip_delay_at_twice_the_limit);
+  RUN_TEST(test_hard_short_trips_on_first_sweep);
+  RUN_TEST(test_retry_recloses_after_delay);
+  RUN_TEST(test_shed_includes_unsampled_outputs);
+  RUN_TEST(test_shed_lowest_priority_then_restore);
+  RUN_TEST(test_sequence_waits_for_settled_current);
+  RUN_TEST(test_sequence_times_out_without_settling);
+  return UNITY_END();
+}
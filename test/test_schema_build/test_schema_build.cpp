@@ -0,0 +1,190 @@
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <chrono>
+#include <PDU_JsonArena.h>
+#include <PDU_Schema.h>
+
+// Builds the PDU's config and command schemas (as setConfigSchema() and
+// setCommandSchema() do at boot, less the fan and HASS library fragments)
+// into the scratch arena and into a default heap JsonDocument, reporting
+// the arena peak, heap bytes and build time of each
+
+#define       OUTPUT_COUNT            16
+#define       BUILD_CYCLES            500
+
+// Same size as the firmware's scratch arena (JSON_ARENA_SCRATCH_SIZE in main.cpp)
+#define       SCRATCH_ARENA_SIZE      12288
+
+// Heap allocations (and bytes requested) made while counting
+bool countHeap = false;
+uint32_t heapAllocations = 0;
+size_t heapBytes = 0;
+
+void * operator new(size_t size)
+{
+  if (countHeap)
+  {
+    heapAllocations++;
+    heapBytes += size;
+  }
+
+  void * ptr = malloc(size ? size : 1);
+  if (ptr == nullptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void * ptr) noexcept { free(ptr); }
+void operator delete(void * ptr, size_t) noexcept { free(ptr); }
+
+// The default heap allocator, counting what it is asked for (ArduinoJson's
+// own calls malloc directly, so operator new never sees it)
+class CountingHeapAllocator : public ArduinoJson::Allocator
+{
+  public:
+    void * allocate(size_t size) override
+    {
+      if (countHeap)
+      {
+        heapAllocations++;
+        heapBytes += size;
+      }
+      return malloc(size);
+    }
+
+    void deallocate(void * ptr) override
+    {
+      free(ptr);
+    }
+
+    void * reallocate(void * ptr, size_t size) override
+    {
+      if (countHeap)
+      {
+        heapAllocations++;
+        heapBytes += size;
+      }
+      return realloc(ptr, size);
+    }
+};
+
+CountingHeapAllocator heapAllocator;
+
+typedef void (*schema_t)(JsonVariant json, uint8_t outputCount);
+
+struct result_t
+{
+  size_t arenaPeak;
+  uint32_t arenaMicros;
+  uint32_t heapAllocations;
+  size_t heapBytes;
+  uint32_t heapMicros;
+};
+
+uint32_t microsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Average over many builds, the way getScratchDocument() reuses the arena
+// (clear, reset, build) against a fresh heap document each time
+result_t benchmark(schema_t schema, const char * name)
+{
+  result_t result;
+
+  StaticJsonArena<SCRATCH_ARENA_SIZE> scratchArena;
+  JsonDocument arenaJson(&scratchArena);
+
+  countHeap = true;
+  heapAllocations = 0;
+  heapBytes = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (uint16_t i = 0; i < BUILD_CYCLES; i++)
+  {
+    arenaJson.clear();
+    scratchArena.reset();
+    schema(arenaJson.as<JsonVariant>(), OUTPUT_COUNT);
+  }
+  result.arenaMicros = microsSince(start);
+
+  countHeap = false;
+  result.arenaPeak = scratchArena.peak();
+
+  TEST_ASSERT_FALSE(arenaJson.overflowed());
+  TEST_ASSERT_EQUAL_UINT32(0, scratchArena.overflows());
+  TEST_ASSERT_EQUAL_UINT32(0, heapAllocations);
+
+  countHeap = true;
+  heapAllocations = 0;
+  heapBytes = 0;
+
+  start = std::chrono::steady_clock::now();
+  for (uint16_t i = 0; i < BUILD_CYCLES; i++)
+  {
+    JsonDocument heapJson(&heapAllocator);
+    schema(heapJson.as<JsonVariant>(), OUTPUT_COUNT);
+    TEST_ASSERT_FALSE(heapJson.overflowed());
+  }
+  result.heapMicros = microsSince(start);
+
+  countHeap = false;
+  result.heapAllocations = heapAllocations / BUILD_CYCLES;
+  result.heapBytes = heapBytes / BUILD_CYCLES;
+
+  printf("%-8s arena %5zu peak of %5zu, %4.1fus/build | heap %5zu bytes requested in %3u allocations, %4.1fus/build\n",
+    name, result.arenaPeak, scratchArena.size(), (double)result.arenaMicros / BUILD_CYCLES,
+    result.heapBytes, (unsigned)result.heapAllocations, (double)result.heapMicros / BUILD_CYCLES);
+
+  return result;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_config_schema_fits_scratch_arena(void)
+{
+  result_t result = benchmark(pduConfigSchema, "config");
+
+  // Host slots are wider than the ESP32's (64 bit pointers), so fitting
+  // here leaves the firmware room for the fan and HASS fragments
+  TEST_ASSERT_TRUE(result.arenaPeak > 0);
+  TEST_ASSERT_TRUE(result.arenaPeak <= SCRATCH_ARENA_SIZE);
+  TEST_ASSERT_TRUE(result.heapAllocations > 0);
+}
+
+void test_command_schema_fits_scratch_arena(void)
+{
+  result_t result = benchmark(pduCommandSchema, "command");
+
+  TEST_ASSERT_TRUE(result.arenaPeak > 0);
+  TEST_ASSERT_TRUE(result.arenaPeak <= SCRATCH_ARENA_SIZE);
+  TEST_ASSERT_TRUE(result.heapAllocations > 0);
+}
+
+void test_config_schema_lists_every_output(void)
+{
+  StaticJsonArena<SCRATCH_ARENA_SIZE> scratchArena;
+  JsonDocument json(&scratchArena);
+  pduConfigSchema(json.as<JsonVariant>(), OUTPUT_COUNT);
+
+  TEST_ASSERT_EQUAL_INT(OUTPUT_COUNT, json["outputs"]["items"]["properties"]["index"]["maximum"].as<int>());
+  TEST_ASSERT_EQUAL_INT(8, json["inaAveragingCount"]["enum"].size());
+  TEST_ASSERT_EQUAL_INT(8, json["inaConversionTimeMicroSeconds"]["enum"].size());
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_config_schema_fits_scratch_arena);
+  RUN_TEST(test_command_schema_fits_scratch_arena);
+  RUN_TEST(test_config_schema_lists_every_output);
+  return UNITY_END();
+}
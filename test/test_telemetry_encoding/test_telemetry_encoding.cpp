@@ -0,0 +1,136 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <ArduinoJson.h>
+
+// Compares the JSON and MessagePack encodings of a fully populated PDU's
+// telemetry, both payload size and the time to serialise into a static
+// buffer, for the object and compact forms (the firmware only publishes
+// JSON, the OXRS MQTT library has no raw publish for binary payloads)
+
+#define       OUTPUT_COUNT            16
+#define       ENCODE_ITERATIONS       1000
+
+char jsonBuffer[4096];
+char msgPackBuffer[4096];
+
+JsonDocument telemetry;
+
+int32_t readingFor(uint8_t output, int32_t base, int32_t spread)
+{
+  return base + (int32_t)((output * 7919) % spread);
+}
+
+void buildObjectTelemetry(JsonDocument & json)
+{
+  JsonArray array = json.to<JsonArray>();
+
+  for (uint8_t output = 0; output < OUTPUT_COUNT; output++)
+  {
+    JsonObject object = array.add<JsonObject>();
+    object["index"] = output + 1;
+    object["mA"] = readingFor(output, 200, 3000);
+    object["mV"] = readingFor(output, 11900, 200);
+    object["mW"] = readingFor(output, 2400, 36000);
+    object["mWh"] = readingFor(output, 10000, 500000);
+    object["mAMin"] = readingFor(output, 150, 3000);
+    object["mAMax"] = readingFor(output, 250, 3000);
+    object["mAAvg"] = readingFor(output, 200, 3000);
+    object["mARms"] = readingFor(output, 210, 3000);
+    object["mVMin"] = readingFor(output, 11850, 200);
+    object["mVMax"] = readingFor(output, 11950, 200);
+    object["mVAvg"] = readingFor(output, 11900, 200);
+    object["mWMax"] = readingFor(output, 3000, 36000);
+    object["mWAvg"] = readingFor(output, 2400, 36000);
+    object["samples"] = 600;
+  }
+}
+
+void buildCompactTelemetry(JsonDocument & json)
+{
+  JsonObject object = json.to<JsonObject>();
+
+  for (uint8_t output = 0; output < OUTPUT_COUNT; output++)
+  {
+    object["index"].add(output + 1);
+    object["mA"].add(readingFor(output, 200, 3000));
+    object["mV"].add(readingFor(output, 11900, 200));
+    object["mW"].add(readingFor(output, 2400, 36000));
+    object["mWh"].add(readingFor(output, 10000, 500000));
+    object["samples"].add(600);
+    object["mAMin"].add(readingFor(output, 150, 3000));
+    object["mAMax"].add(readingFor(output, 250, 3000));
+    object["mAAvg"].add(readingFor(output, 200, 3000));
+    object["mARms"].add(readingFor(output, 210, 3000));
+    object["mVMin"].add(readingFor(output, 11850, 200));
+    object["mVMax"].add(readingFor(output, 11950, 200));
+    object["mVAvg"].add(readingFor(output, 11900, 200));
+    object["mWMax"].add(readingFor(output, 3000, 36000));
+    object["mWAvg"].add(readingFor(output, 2400, 36000));
+  }
+}
+
+template <typename Encode>
+double timeEncode(Encode encode)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (uint16_t i = 0; i < ENCODE_ITERATIONS; i++)
+  {
+    encode();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::micro>(elapsed).count() / ENCODE_ITERATIONS;
+}
+
+void compareEncodings(const char * form)
+{
+  size_t jsonBytes = serializeJson(telemetry, jsonBuffer, sizeof(jsonBuffer));
+  size_t msgPackBytes = serializeMsgPack(telemetry, msgPackBuffer, sizeof(msgPackBuffer));
+
+  double jsonTime = timeEncode([]() { serializeJson(telemetry, jsonBuffer, sizeof(jsonBuffer)); });
+  double msgPackTime = timeEncode([]() { serializeMsgPack(telemetry, msgPackBuffer, sizeof(msgPackBuffer)); });
+
+  printf("%-8s json %5zu bytes %7.2fus, msgpack %5zu bytes %7.2fus\n", form, jsonBytes, jsonTime, msgPackBytes, msgPackTime);
+
+  TEST_ASSERT_TRUE(jsonBytes > 0 && jsonBytes < sizeof(jsonBuffer));
+  TEST_ASSERT_TRUE(msgPackBytes > 0 && msgPackBytes < sizeof(msgPackBuffer));
+  TEST_ASSERT_TRUE(msgPackBytes < jsonBytes);
+
+  // Decodes back to exactly the same document
+  JsonDocument decoded;
+  TEST_ASSERT_TRUE(deserializeMsgPack(decoded, msgPackBuffer, msgPackBytes) == DeserializationError::Ok);
+
+  static char roundTrip[4096];
+  serializeJson(decoded, roundTrip, sizeof(roundTrip));
+  TEST_ASSERT_EQUAL(0, strcmp(jsonBuffer, roundTrip));
+}
+
+void setUp(void)
+{
+  telemetry.clear();
+}
+
+void tearDown(void)
+{
+}
+
+void test_object_telemetry_encoding(void)
+{
+  buildObjectTelemetry(telemetry);
+  compareEncodings("objects");
+}
+
+void test_compact_telemetry_encoding(void)
+{
+  buildCompactTelemetry(telemetry);
+  compareEncodings("compact");
+}
+
+int main(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_object_telemetry_encoding);
+  RUN_TEST(test_compact_telemetry_encoding);
+  return UNITY_END();
+}